@@ -0,0 +1,172 @@
+// Measures how ConcurrentPool::Pool from cpp/object-pool.h scales as more
+// threads create and destroy objects at once, compared to a pool behind a
+// mutex and to new and delete. Objects are freed and made again in bursts
+// bigger than a thread's cache, so every round goes through the shared
+// stack. Build with optimizations, e.g.:
+//
+//     c++ -std=c++11 -O2 -pthread main.cpp -o concurrent_pool
+
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/object-pool.h"
+
+static const int MAX_THREADS = 32;
+static const int OPS_PER_THREAD = 1000000;
+
+// How many objects each thread keeps alive at once.
+static const int NUM_LIVE = 256;
+
+// How many objects each thread destroys before creating them again. It's
+// twice the cache size so that each burst spills into the shared free stack
+// and then has to be refilled from it.
+static const int BURST_SIZE = 2 * ConcurrentPool::Pool<int>::CACHE_SIZE;
+static const int NUM_ROUNDS = OPS_PER_THREAD / BURST_SIZE;
+
+struct Projectile
+{
+  Projectile(double x, double y)
+  : x(x), y(y), xVel(1), yVel(1)
+  {}
+
+  double x, y;
+  double xVel, yVel;
+};
+
+// Runs [work] on [numThreads] threads at once and returns the wall time.
+template <class Work>
+double runThreads(int numThreads, Work work)
+{
+  std::vector<std::thread> threads;
+  startProfile();
+  for (int t = 0; t < numThreads; t++)
+  {
+    threads.push_back(std::thread(work, t));
+  }
+  for (int t = 0; t < numThreads; t++) threads[t].join();
+  return endProfile();
+}
+
+double testConcurrent(int numThreads)
+{
+  // Leave room for the slots each thread's cache can be holding on to.
+  typedef ConcurrentPool::Pool<Projectile> Pool;
+  Pool pool(MAX_THREADS * (NUM_LIVE + Pool::CACHE_SIZE));
+
+  return runThreads(numThreads, [&](int t) {
+    ConcurrentPool::Pool<Projectile>::Cache cache(pool);
+    Projectile* live[NUM_LIVE];
+    for (int i = 0; i < NUM_LIVE; i++) live[i] = cache.create(t, i);
+
+    int victim = 0;
+    for (int round = 0; round < NUM_ROUNDS; round++)
+    {
+      // Step through the live objects out of order.
+      int burst[BURST_SIZE];
+      for (int i = 0; i < BURST_SIZE; i++)
+      {
+        victim = (victim + 97) % NUM_LIVE;
+        burst[i] = victim;
+        cache.destroy(live[victim]);
+      }
+
+      for (int i = 0; i < BURST_SIZE; i++)
+      {
+        live[burst[i]] = cache.create(t, round);
+      }
+    }
+
+    for (int i = 0; i < NUM_LIVE; i++) cache.destroy(live[i]);
+  });
+}
+
+double testLocked(int numThreads)
+{
+  HandlePool::Pool<Projectile> pool(MAX_THREADS * NUM_LIVE);
+  std::mutex mutex;
+
+  return runThreads(numThreads, [&](int t) {
+    HandlePool::Handle live[NUM_LIVE];
+    for (int i = 0; i < NUM_LIVE; i++)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      live[i] = pool.create(t, i);
+    }
+
+    int victim = 0;
+    for (int round = 0; round < NUM_ROUNDS; round++)
+    {
+      // Step through the live objects out of order.
+      int burst[BURST_SIZE];
+      for (int i = 0; i < BURST_SIZE; i++)
+      {
+        victim = (victim + 97) % NUM_LIVE;
+        burst[i] = victim;
+        std::lock_guard<std::mutex> lock(mutex);
+        pool.destroy(live[victim]);
+      }
+
+      for (int i = 0; i < BURST_SIZE; i++)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        live[burst[i]] = pool.create(t, round);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < NUM_LIVE; i++) pool.destroy(live[i]);
+  });
+}
+
+double testNewDelete(int numThreads)
+{
+  return runThreads(numThreads, [&](int t) {
+    Projectile* live[NUM_LIVE];
+    for (int i = 0; i < NUM_LIVE; i++) live[i] = new Projectile(t, i);
+
+    int victim = 0;
+    for (int round = 0; round < NUM_ROUNDS; round++)
+    {
+      // Step through the live objects out of order.
+      int burst[BURST_SIZE];
+      for (int i = 0; i < BURST_SIZE; i++)
+      {
+        victim = (victim + 97) % NUM_LIVE;
+        burst[i] = victim;
+        delete live[victim];
+      }
+
+      for (int i = 0; i < BURST_SIZE; i++)
+      {
+        live[burst[i]] = new Projectile(t, round);
+      }
+    }
+
+    for (int i = 0; i < NUM_LIVE; i++) delete live[i];
+  });
+}
+
+int main(int argc, const char * argv[])
+{
+  printf("threads  %16s  %16s  %16s\n", "concurrent Mops/s", "locked Mops/s",
+         "new/delete Mops/s");
+
+  for (int numThreads = 1; numThreads <= MAX_THREADS; numThreads *= 2)
+  {
+    // Each op is one destroy and one create.
+    double numOps = (double)numThreads * NUM_ROUNDS * BURST_SIZE;
+    double concurrent = testConcurrent(numThreads);
+    double locked = testLocked(numThreads);
+    double newDelete = testNewDelete(numThreads);
+
+    printf("%7d  %16.2f  %16.2f  %16.2f\n", numThreads,
+           numOps * 1000 / concurrent, numOps * 1000 / locked,
+           numOps * 1000 / newDelete);
+  }
+
+  return 0;
+}
@@ -0,0 +1,117 @@
+// Compares updating objects in a million-slot HandlePool::Pool from
+// cpp/object-pool.h when its slots are kept on ordinary 4KB pages and when
+// they are on 2MB huge pages. Each row says what backing the OS actually
+// gave it. Build with optimizations, e.g.:
+//
+//     c++ -std=c++11 -O2 main.cpp -o huge_pages
+//
+// On Linux, explicit huge pages need to be reserved first, e.g.:
+//
+//     echo 64 | sudo tee /proc/sys/vm/nr_hugepages
+//
+// Otherwise the pool asks for transparent huge pages instead.
+
+#include <iostream>
+#include <vector>
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/object-pool.h"
+
+static const int NUM_PARTICLES = 1000000;
+static const int NUM_PASSES = 20;
+
+struct Particle
+{
+  Particle(double x, double y, double xVel, double yVel)
+  : x(x), y(y), xVel(xVel), yVel(yVel)
+  {}
+
+  double x, y;
+  double xVel, yVel;
+};
+
+long sum = 0;
+
+void moveParticle(Particle& particle)
+{
+  particle.x += particle.xVel;
+  particle.y += particle.yVel;
+  sum += (long)particle.x;
+}
+
+void describe(const PoolMemory::Block& block)
+{
+  if (block.hugeTlb)
+  {
+    printf("hugetlb pages");
+  }
+  else if (block.transparentHuge)
+  {
+    printf("transparent huge pages");
+  }
+  else if (block.smallOnly)
+  {
+    printf("small pages only");
+  }
+  else if (block.mapped)
+  {
+    printf("mapped small pages");
+  }
+  else
+  {
+    printf("heap");
+  }
+}
+
+void test(PoolMemory::PageSize pageSize)
+{
+  HandlePool::Pool<Particle> pool(NUM_PARTICLES, pageSize);
+  std::vector<HandlePool::Handle> handles(NUM_PARTICLES);
+  for (int i = 0; i < NUM_PARTICLES; i++)
+  {
+    handles[i] = pool.create(i, i, 1, -1);
+  }
+
+  // Visit the particles in a random order, like following handles stored
+  // in other objects would. This is where the TLB hurts.
+  shuffle(&handles[0], NUM_PARTICLES);
+
+  startProfile();
+  for (int pass = 0; pass < NUM_PASSES; pass++)
+  {
+    for (int i = 0; i < NUM_PARTICLES; i++)
+    {
+      moveParticle(*pool.get(handles[i]));
+    }
+  }
+  double random = endProfile();
+
+  startProfile();
+  for (int pass = 0; pass < NUM_PASSES; pass++)
+  {
+    pool.forEachLive(moveParticle);
+  }
+  double linear = endProfile();
+  consume(sum);
+
+  double numUpdates = (double)NUM_PARTICLES * NUM_PASSES;
+  printf("%-6s  random %7.2f ns/update  linear %7.2f ns/update  (",
+         pageSize == PoolMemory::HUGE_PAGES ? "2MB" : "4KB",
+         random / numUpdates, linear / numUpdates);
+  describe(pool.memory());
+  printf(")\n");
+}
+
+int main(int argc, const char * argv[])
+{
+  srand(1234);
+
+  for (int i = 0; i < 4; i++)
+  {
+    test(PoolMemory::SMALL_PAGES);
+    test(PoolMemory::HUGE_PAGES);
+  }
+
+  return 0;
+}
@@ -0,0 +1,128 @@
+// Measures how EventQueue::MpscQueue::Queue from cpp/event-queue.h scales
+// from 1 to 32 producer threads feeding one consumer, compared to a queue
+// behind a mutex. Build with optimizations, e.g.:
+//
+//     c++ -std=c++11 -O2 -pthread main.cpp -o mpsc_queue
+
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/event-queue.h"
+
+using namespace EventQueue;
+
+static const int MAX_PRODUCERS = 32;
+static const int CAPACITY = 4096;
+
+// Split across however many producers there are, so every run moves the
+// same number of messages.
+static const int NUM_MESSAGES = 4000000;
+
+typedef MpscQueue::Queue<PlayMessage, CAPACITY> LockFreeQueue;
+
+// The book's ring with a lock around it, for comparison.
+class LockedQueue
+{
+public:
+  LockedQueue()
+  : head_(0),
+    tail_(0)
+  {}
+
+  void push(const PlayMessage& message)
+  {
+    for (;;)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if ((tail_ + 1) % CAPACITY != head_)
+        {
+          items_[tail_] = message;
+          tail_ = (tail_ + 1) % CAPACITY;
+          return;
+        }
+      }
+
+      std::this_thread::yield();
+    }
+  }
+
+  int popBatch(PlayMessage* messages, int max)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int count = 0;
+    while (count < max && head_ != tail_)
+    {
+      messages[count++] = items_[head_];
+      head_ = (head_ + 1) % CAPACITY;
+    }
+
+    return count;
+  }
+
+private:
+  std::mutex mutex_;
+  PlayMessage items_[CAPACITY];
+  int head_;
+  int tail_;
+};
+
+// Returns millions of messages per second.
+template <class Queue>
+double run(int numProducers)
+{
+  // Too big for the stack. Each run leaves it empty, so later runs can
+  // reuse it.
+  static Queue queue;
+
+  int perProducer = NUM_MESSAGES / numProducers;
+  int total = perProducer * numProducers;
+
+  startProfile();
+  std::vector<std::thread> producers;
+  for (int p = 0; p < numProducers; p++)
+  {
+    producers.push_back(std::thread([perProducer, p]() {
+      for (int i = 0; i < perProducer; i++)
+      {
+        PlayMessage message = { p, i };
+        queue.push(message);
+      }
+    }));
+  }
+
+  long sum = 0;
+  PlayMessage batch[64];
+  for (int received = 0; received < total;)
+  {
+    int count = queue.popBatch(batch, 64);
+    if (count == 0) std::this_thread::yield();
+
+    for (int i = 0; i < count; i++) sum += batch[i].volume;
+    received += count;
+  }
+
+  for (int p = 0; p < numProducers; p++) producers[p].join();
+  double elapsed = endProfile();
+  consume(sum);
+
+  return total * 1000.0 / elapsed;
+}
+
+int main(int argc, const char * argv[])
+{
+  printf("%9s  %16s  %16s\n", "producers", "lock-free Mmsg/s",
+         "locked Mmsg/s");
+
+  for (int numProducers = 1; numProducers <= MAX_PRODUCERS; numProducers *= 2)
+  {
+    printf("%9d  %16.2f  %16.2f\n", numProducers,
+           run<LockFreeQueue>(numProducers), run<LockedQueue>(numProducers));
+  }
+
+  return 0;
+}
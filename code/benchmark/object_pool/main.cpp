@@ -0,0 +1,219 @@
+// Compares HandlePool::Pool from cpp/object-pool.h against allocating each
+// object with new and delete and against a std::vector. Build with
+// optimizations, e.g.:
+//
+//     c++ -std=c++11 -O2 main.cpp -o object_pool
+
+#include <iostream>
+#include <vector>
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/object-pool.h"
+
+static const int NUM_FRAMES = 200;
+static const int NUM_OBJECTS = 100000;
+
+// Each frame, this many objects die and are replaced.
+static const int NUM_CHURN = 10000;
+
+struct Projectile
+{
+  Projectile(double x, double y, double xVel, double yVel, int lifetime)
+  : x(x), y(y), xVel(xVel), yVel(yVel), framesLeft(lifetime)
+  {}
+
+  double x, y;
+  double xVel, yVel;
+  int framesLeft;
+};
+
+// Every test kills the objects at the same random positions in its list of
+// live objects each frame, then creates the same number of new ones.
+std::vector<int> victims;
+
+void makeVictims()
+{
+  victims.resize(NUM_FRAMES * NUM_CHURN);
+  for (size_t i = 0; i < victims.size(); i++)
+  {
+    victims[i] = randRange(0, NUM_OBJECTS);
+  }
+}
+
+double testPool()
+{
+  HandlePool::Pool<Projectile> pool(NUM_OBJECTS);
+  std::vector<HandlePool::Handle> handles(NUM_OBJECTS);
+  for (int i = 0; i < NUM_OBJECTS; i++)
+  {
+    handles[i] = pool.create(i, i, 1, 1, 100);
+  }
+
+  long sum = 0;
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    for (int i = 0; i < NUM_CHURN; i++)
+    {
+      int victim = victims[frame * NUM_CHURN + i];
+      sum += (long)pool.get(handles[victim])->x;
+      pool.destroy(handles[victim]);
+      handles[victim] = pool.create(i, frame, 1, 1, 100);
+    }
+  }
+  double elapsed = endProfile();
+  consume(sum);
+  return elapsed;
+}
+
+double testNewDelete()
+{
+  std::vector<Projectile*> objects(NUM_OBJECTS);
+  for (int i = 0; i < NUM_OBJECTS; i++)
+  {
+    objects[i] = new Projectile(i, i, 1, 1, 100);
+  }
+
+  long sum = 0;
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    for (int i = 0; i < NUM_CHURN; i++)
+    {
+      int victim = victims[frame * NUM_CHURN + i];
+      sum += (long)objects[victim]->x;
+      delete objects[victim];
+      objects[victim] = new Projectile(i, frame, 1, 1, 100);
+    }
+  }
+  double elapsed = endProfile();
+  consume(sum);
+
+  for (int i = 0; i < NUM_OBJECTS; i++) delete objects[i];
+  return elapsed;
+}
+
+// Stores the objects by value and removes them by swapping the last one into
+// the hole, the usual way to keep a vector dense.
+double testVector()
+{
+  std::vector<Projectile> objects;
+  objects.reserve(NUM_OBJECTS);
+  for (int i = 0; i < NUM_OBJECTS; i++)
+  {
+    objects.push_back(Projectile(i, i, 1, 1, 100));
+  }
+
+  long sum = 0;
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    for (int i = 0; i < NUM_CHURN; i++)
+    {
+      int victim = victims[frame * NUM_CHURN + i];
+      sum += (long)objects[victim].x;
+      objects[victim] = objects.back();
+      objects.pop_back();
+      objects.push_back(Projectile(i, frame, 1, 1, 100));
+    }
+  }
+  double elapsed = endProfile();
+  consume(sum);
+  return elapsed;
+}
+
+// A million-slot pool with only 1% of the slots live.
+static const int SPARSE_CAPACITY = 1000000;
+static const int SPARSE_LIVE = SPARSE_CAPACITY / 100;
+static const int SPARSE_PASSES = 100;
+
+long sparseSum = 0;
+
+void sumProjectile(Projectile& projectile)
+{
+  sparseSum += (long)projectile.x;
+}
+
+double testBitmapIteration()
+{
+  HandlePool::Pool<Projectile> pool(SPARSE_CAPACITY);
+  std::vector<HandlePool::Handle> handles(SPARSE_CAPACITY);
+  for (int i = 0; i < SPARSE_CAPACITY; i++)
+  {
+    handles[i] = pool.create(i, i, 1, 1, 100);
+  }
+
+  // Leave every hundredth one.
+  for (int i = 0; i < SPARSE_CAPACITY; i++)
+  {
+    if (i % 100 != 0) pool.destroy(handles[i]);
+  }
+
+  startProfile();
+  for (int i = 0; i < SPARSE_PASSES; i++) pool.forEachLive(sumProjectile);
+  double elapsed = endProfile();
+  consume(sparseSum);
+  return elapsed;
+}
+
+// Walks every slot and checks a flag, like Temp3::GenericPool's inUse_.
+double testFlagIteration()
+{
+  std::vector<Projectile> objects(SPARSE_CAPACITY,
+                                  Projectile(0, 0, 1, 1, 100));
+  bool* inUse = new bool[SPARSE_CAPACITY];
+  for (int i = 0; i < SPARSE_CAPACITY; i++)
+  {
+    objects[i].x = i;
+    inUse[i] = i % 100 == 0;
+  }
+
+  startProfile();
+  for (int i = 0; i < SPARSE_PASSES; i++)
+  {
+    for (int j = 0; j < SPARSE_CAPACITY; j++)
+    {
+      if (inUse[j]) sumProjectile(objects[j]);
+    }
+  }
+  double elapsed = endProfile();
+  consume(sparseSum);
+
+  delete [] inUse;
+  return elapsed;
+}
+
+int main(int argc, const char * argv[])
+{
+  srand(1234);
+  makeVictims();
+
+  double numOps = (double)NUM_FRAMES * NUM_CHURN;
+
+  for (int i = 0; i < 4; i++)
+  {
+    double pool = testPool();
+    double newDelete = testNewDelete();
+    double vector = testVector();
+
+    printf("       pool %8.2f ns/op\n", pool / numOps);
+    printf(" new/delete %8.2f ns/op  %6.2fx\n", newDelete / numOps,
+           newDelete / pool);
+    printf("     vector %8.2f ns/op  %6.2fx\n", vector / numOps,
+           vector / pool);
+  }
+
+  // Iterating a sparse pool.
+  for (int i = 0; i < 4; i++)
+  {
+    double bitmap = testBitmapIteration();
+    double flags = testFlagIteration();
+
+    printf("1%% live, bitmap %8.3f ms/pass\n", bitmap / SPARSE_PASSES / 1e6);
+    printf("1%% live,  flags %8.3f ms/pass  %6.2fx\n",
+           flags / SPARSE_PASSES / 1e6, flags / bitmap);
+  }
+
+  return 0;
+}
@@ -0,0 +1,76 @@
+// Measures how DensePool::ParticlePool::animate() from cpp/object-pool.h
+// scales when the particles are split across worker threads. Build with
+// optimizations, e.g.:
+//
+//     c++ -std=c++11 -O2 -pthread main.cpp -o parallel_animate
+
+#include <iostream>
+#include <thread>
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/object-pool.h"
+
+static const int NUM_PARTICLES = 1000000;
+static const int NUM_FRAMES = 100;
+
+// Particles live for a random number of frames up to this, and dead ones
+// are replaced every frame, so there's always recycling to do.
+static const int MAX_LIFETIME = 200;
+
+class Spawner
+{
+public:
+  void operator()(int i, DensePool::Particle& particle) const
+  {
+    particle.init(i, i, 1, -1, rand() % MAX_LIFETIME + 1);
+  }
+};
+
+// Returns the time spent animating, or the serial time if [workers] is
+// NULL.
+double test(JobSystem::Workers* workers)
+{
+  srand(1234);
+  DensePool::ParticlePool pool(NUM_PARTICLES);
+  pool.createBatch(NUM_PARTICLES, Spawner());
+
+  double elapsed = 0;
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    startProfile();
+    if (workers == NULL)
+    {
+      pool.animate();
+    }
+    else
+    {
+      pool.animate(*workers);
+    }
+    elapsed += endProfile();
+
+    pool.createBatch(NUM_PARTICLES - pool.numLive(), Spawner());
+  }
+
+  return elapsed;
+}
+
+int main(int argc, const char * argv[])
+{
+  int numCores = (int)std::thread::hardware_concurrency();
+  if (numCores < 1) numCores = 1;
+
+  double numUpdates = (double)NUM_PARTICLES * NUM_FRAMES;
+  double serial = test(NULL);
+  printf("serial     %7.3f ns/particle\n", serial / numUpdates);
+
+  for (int numWorkers = 1; numWorkers <= numCores * 2; numWorkers *= 2)
+  {
+    JobSystem::Workers workers(numWorkers);
+    double parallel = test(&workers);
+    printf("%2d workers %7.3f ns/particle  %6.2fx speedup\n", numWorkers,
+           parallel / numUpdates, serial / parallel);
+  }
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+// Compares animating a million particles stored as an array of Particle
+// objects (Version1 in cpp/object-pool.h) against SoAPool::ParticlePool,
+// which stores each field in its own array. Build with optimizations and
+// let the compiler use AVX if the machine has it, e.g.:
+//
+//     c++ -std=c++11 -O2 -march=native main.cpp -o particle_soa
+
+#include <iostream>
+#include <vector>
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/object-pool.h"
+
+static const int NUM_PARTICLES = 1000000;
+static const int NUM_FRAMES = 100;
+
+// Long enough that every particle lives through the whole test.
+static const int LIFETIME = NUM_FRAMES + 1;
+
+double randVelocity()
+{
+  return randRange(-100, 101) / 100.0;
+}
+
+double testArrayOfStructs()
+{
+  std::vector<Version1::Particle> particles(NUM_PARTICLES);
+  for (int i = 0; i < NUM_PARTICLES; i++)
+  {
+    particles[i].init(i, i, randVelocity(), randVelocity(), LIFETIME);
+  }
+
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    // This is what Version1::ParticlePool::animate() does.
+    for (int i = 0; i < NUM_PARTICLES; i++) particles[i].animate();
+  }
+  double elapsed = endProfile();
+
+  // Make sure the particles can't be optimized away.
+  long sum = 0;
+  for (int i = 0; i < NUM_PARTICLES; i++) sum += particles[i].inUse();
+  consume(sum);
+  return elapsed;
+}
+
+double testStructOfArrays()
+{
+  SoAPool::ParticlePool pool(NUM_PARTICLES);
+  for (int i = 0; i < NUM_PARTICLES; i++)
+  {
+    pool.create(i, i, randVelocity(), randVelocity(), LIFETIME);
+  }
+
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++) pool.animate();
+  double elapsed = endProfile();
+
+  long sum = 0;
+  for (int i = 0; i < NUM_PARTICLES; i++) sum += (long)pool.x(i);
+  consume(sum);
+  return elapsed;
+}
+
+int main(int argc, const char * argv[])
+{
+  srand(1234);
+
+#if defined(__AVX__)
+  printf("using AVX\n");
+#elif defined(__SSE2__)
+  printf("using SSE2\n");
+#else
+  printf("using scalar code\n");
+#endif
+
+  double numUpdates = (double)NUM_PARTICLES * NUM_FRAMES;
+  for (int i = 0; i < 4; i++)
+  {
+    double aos = testArrayOfStructs();
+    double soa = testStructOfArrays();
+
+    printf("array of structs %8.3f ns/particle\n", aos / numUpdates);
+    printf("struct of arrays %8.3f ns/particle  %6.2fx\n", soa / numUpdates,
+           soa / aos);
+  }
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+// Compares standard containers using the default allocator against the
+// same containers using PoolResource::BlockResource and
+// PoolResource::FrameArena from cpp/object-pool.h. Needs C++17. Build with
+// optimizations, e.g.:
+//
+//     c++ -std=c++17 -O2 main.cpp -o pmr
+
+#include <iostream>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/object-pool.h"
+
+static const int NUM_FRAMES = 1000;
+
+// What a frame of gameplay code builds and throws away: a scratch list and
+// a lookup table.
+static const int NUM_ITEMS = 2000;
+static const int NUM_ENTRIES = 1000;
+
+long doFrame(std::pmr::memory_resource* resource, int frame)
+{
+  std::pmr::vector<int> items(resource);
+  for (int i = 0; i < NUM_ITEMS; i++) items.push_back(i + frame);
+
+  std::pmr::unordered_map<int, int> table(resource);
+  for (int i = 0; i < NUM_ENTRIES; i++) table[i * 31 + frame] = i;
+
+  long sum = 0;
+  for (int i = 0; i < NUM_ENTRIES; i++) sum += table[i * 31 + frame];
+  return sum + items.back();
+}
+
+double testDefault()
+{
+  long sum = 0;
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    sum += doFrame(std::pmr::get_default_resource(), frame);
+  }
+  double elapsed = endProfile();
+  consume(sum);
+  return elapsed;
+}
+
+// Map nodes come from the pool. The vector and the map's bucket array are
+// too big for a block, so they go to the default allocator.
+double testBlocks()
+{
+  PoolResource::BlockResource<64> blocks(NUM_ENTRIES * 2);
+
+  long sum = 0;
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    sum += doFrame(&blocks, frame);
+  }
+  double elapsed = endProfile();
+  consume(sum);
+  return elapsed;
+}
+
+double testArena()
+{
+  PoolResource::FrameArena arena(1024 * 1024);
+
+  long sum = 0;
+  int numOverflows = 0;
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    sum += doFrame(&arena, frame);
+
+    // reset() forgets the overflows, so count them first.
+    numOverflows += arena.numOverflows();
+    arena.reset();
+  }
+  double elapsed = endProfile();
+  consume(sum);
+
+  if (numOverflows > 0) printf("arena overflowed %d times!\n", numOverflows);
+  return elapsed;
+}
+
+// The arena feeds the pool, so the whole frame stays off the heap.
+double testBlocksOverArena()
+{
+  PoolResource::FrameArena arena(1024 * 1024);
+  PoolResource::BlockResource<64> blocks(NUM_ENTRIES * 2, &arena);
+
+  long sum = 0;
+  startProfile();
+  for (int frame = 0; frame < NUM_FRAMES; frame++)
+  {
+    sum += doFrame(&blocks, frame);
+    arena.reset();
+  }
+  double elapsed = endProfile();
+  consume(sum);
+  return elapsed;
+}
+
+int main(int argc, const char * argv[])
+{
+  for (int i = 0; i < 4; i++)
+  {
+    double heap = testDefault();
+    double blocks = testBlocks();
+    double arena = testArena();
+    double both = testBlocksOverArena();
+
+    printf("      default %8.2f us/frame\n", heap / NUM_FRAMES / 1000);
+    printf("  pool blocks %8.2f us/frame  %6.2fx\n",
+           blocks / NUM_FRAMES / 1000, blocks / heap);
+    printf("  frame arena %8.2f us/frame  %6.2fx\n",
+           arena / NUM_FRAMES / 1000, arena / heap);
+    printf(" blocks+arena %8.2f us/frame  %6.2fx\n",
+           both / NUM_FRAMES / 1000, both / heap);
+  }
+
+  return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Uses wall clock time instead of clock() so that benchmarks that spread
+// work across threads aren't charged for every thread's CPU time.
+std::chrono::steady_clock::time_point startTime;
+
+void startProfile()
+{
+  startTime = std::chrono::steady_clock::now();
+}
+
+// Returns the nanoseconds elapsed since the last call to startProfile().
+double endProfile()
+{
+  std::chrono::steady_clock::duration elapsed =
+      std::chrono::steady_clock::now() - startTime;
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      elapsed).count();
+}
+
+// Get random value in the given range (half-inclusive).
+int randRange(int m, int n)
+{
+  return rand() % (n - m) + m;
+}
+
+// Make sure the code leading to the argument to this call isn't compiled out.
+void consume(long sum)
+{
+  if (sum == 123) printf("!");
+}
+
+template <class T>
+void shuffle(T* array, int length)
+{
+  for (int i = 0; i < length; i++)
+  {
+    int j = randRange(i, length);
+    T temp = array[i];
+    array[i] = array[j];
+    array[j] = temp;
+  }
+}
@@ -0,0 +1,399 @@
+// Compares the spatial partitions in cpp/spatial-partition.h against the
+// naive pairwise check. Build with optimizations, e.g.:
+//
+//     c++ -std=c++11 -O2 -pthread main.cpp -o spatial_partition
+
+#include <iostream>
+#include <vector>
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/spatial-partition.h"
+
+using namespace SpatialPartition;
+
+static const int WORLD_SIZE = 200;
+static const int NUM_QUERIES = 10000;
+
+// Skip any run that would need more than this many pairwise comparisons in
+// the melee phase. Otherwise the naive check never finishes at 1M units.
+static const double MAX_MELEE_PAIRS = 2e9;
+
+// Where every unit is at the start and where each one moves to.
+struct Population
+{
+  const char* name;
+  std::vector<double> x, y;
+  std::vector<double> movedX, movedY;
+  std::vector<double> queryX, queryY;
+};
+
+int clamp(int value)
+{
+  if (value < 0) return 0;
+  if (value >= WORLD_SIZE) return WORLD_SIZE - 1;
+  return value;
+}
+
+// Positions are whole numbers so that the exact-position melee check in the
+// grids actually finds some hits.
+void generate(Population& population, const char* name, int numUnits)
+{
+  population.name = name;
+  population.x.resize(numUnits);
+  population.y.resize(numUnits);
+  population.movedX.resize(numUnits);
+  population.movedY.resize(numUnits);
+
+  static const int NUM_CLUSTERS = 8;
+  int clusterX[NUM_CLUSTERS];
+  int clusterY[NUM_CLUSTERS];
+  for (int i = 0; i < NUM_CLUSTERS; i++)
+  {
+    clusterX[i] = randRange(20, WORLD_SIZE - 20);
+    clusterY[i] = randRange(20, WORLD_SIZE - 20);
+  }
+
+  bool clustered = name[0] == 'c';
+  bool moving = name[0] == 'm';
+
+  for (int i = 0; i < numUnits; i++)
+  {
+    if (clustered)
+    {
+      // Summing a few small offsets piles units up near the center.
+      int cluster = i % NUM_CLUSTERS;
+      population.x[i] = clamp(clusterX[cluster] + randRange(-6, 7) +
+                              randRange(-6, 7) + randRange(-6, 7));
+      population.y[i] = clamp(clusterY[cluster] + randRange(-6, 7) +
+                              randRange(-6, 7) + randRange(-6, 7));
+    }
+    else
+    {
+      population.x[i] = randRange(0, WORLD_SIZE);
+      population.y[i] = randRange(0, WORLD_SIZE);
+    }
+
+    // Moving units travel far enough to usually cross into another cell.
+    // The others just shuffle in place.
+    int step = moving ? 25 : 1;
+    population.movedX[i] = clamp((int)population.x[i] +
+                                 randRange(-step, step + 1));
+    population.movedY[i] = clamp((int)population.y[i] +
+                                 randRange(-step, step + 1));
+  }
+
+  population.queryX.resize(NUM_QUERIES);
+  population.queryY.resize(NUM_QUERIES);
+  for (int i = 0; i < NUM_QUERIES; i++)
+  {
+    int unit = randRange(0, numUnits);
+    population.queryX[i] = population.movedX[unit];
+    population.queryY[i] = population.movedY[unit];
+  }
+}
+
+// Estimates how many comparisons a grid with cells of [cellSize] will do in
+// its melee phase.
+double meleePairs(const Population& population, int cellSize)
+{
+  int numCells = (WORLD_SIZE + cellSize - 1) / cellSize;
+  std::vector<double> counts(numCells * numCells, 0);
+  for (size_t i = 0; i < population.movedX.size(); i++)
+  {
+    counts[(int)(population.movedX[i] / cellSize) * numCells +
+           (int)(population.movedY[i] / cellSize)]++;
+  }
+
+  double pairs = 0;
+  for (size_t i = 0; i < counts.size(); i++)
+  {
+    pairs += counts[i] * (counts[i] - 1) / 2;
+  }
+
+  return pairs;
+}
+
+// Each partition is wrapped in a class with the same methods so that one
+// function can time them all.
+class Naive
+{
+public:
+  static const char* name() { return "naive"; }
+
+  static double pairs(const Population& population)
+  {
+    double n = (double)population.x.size();
+    return n * (n - 1) / 2;
+  }
+
+  ~Naive()
+  {
+    for (size_t i = 0; i < units_.size(); i++) delete units_[i];
+  }
+
+  void build(const Population& population)
+  {
+    for (size_t i = 0; i < population.x.size(); i++)
+    {
+      units_.push_back(new Unit("", position(population.x[i],
+                                             population.y[i])));
+    }
+  }
+
+  void move(const Population& population)
+  {
+    for (size_t i = 0; i < units_.size(); i++)
+    {
+      *units_[i] = Unit("", position(population.movedX[i],
+                                     population.movedY[i]));
+    }
+  }
+
+  void melee()
+  {
+    NaiveCollision::handleMelee(&units_[0], (int)units_.size());
+    NaiveCollision::hits.clear();
+  }
+
+  bool query(double x, double y)
+  {
+    int target = position(x, y);
+    for (size_t i = 0; i < units_.size(); i++)
+    {
+      if (units_[i]->position() == target) return true;
+    }
+
+    return false;
+  }
+
+private:
+  // The naive units only have a single coordinate, so flatten the grid.
+  static int position(double x, double y)
+  {
+    return (int)x * WORLD_SIZE + (int)y;
+  }
+
+  std::vector<Unit*> units_;
+};
+
+class Fixed
+{
+public:
+  static const char* name() { return "fixed grid"; }
+
+  static double pairs(const Population& population)
+  {
+    return meleePairs(population, FixedGrid::Grid::CELL_SIZE);
+  }
+
+  ~Fixed()
+  {
+    for (size_t i = 0; i < units_.size(); i++) delete units_[i];
+  }
+
+  void build(const Population& population)
+  {
+    for (size_t i = 0; i < population.x.size(); i++)
+    {
+      units_.push_back(new FixedGrid::Unit(&grid_, population.x[i],
+                                           population.y[i]));
+    }
+  }
+
+  void move(const Population& population)
+  {
+    for (size_t i = 0; i < units_.size(); i++)
+    {
+      units_[i]->move(population.movedX[i], population.movedY[i]);
+    }
+  }
+
+  void melee() { grid_.handleMelee(); }
+
+  bool query(double x, double y) { return grid_.findAt(x, y) != NULL; }
+
+private:
+  FixedGrid::Grid grid_;
+  std::vector<FixedGrid::Unit*> units_;
+};
+
+// Times the live grid plus publishing a snapshot after the build and move
+// phases. Queries go through the snapshot like a reader thread's would.
+class Snapshot
+{
+public:
+  static const char* name() { return "snapshot grid"; }
+
+  static double pairs(const Population& population)
+  {
+    return meleePairs(population, SnapshotGrid::CELL_SIZE);
+  }
+
+  ~Snapshot()
+  {
+    for (size_t i = 0; i < units_.size(); i++) delete units_[i];
+  }
+
+  void build(const Population& population)
+  {
+    for (size_t i = 0; i < population.x.size(); i++)
+    {
+      units_.push_back(new SnapshotGrid::Unit(&grid_, population.x[i],
+                                              population.y[i]));
+    }
+    grid_.publish();
+  }
+
+  void move(const Population& population)
+  {
+    for (size_t i = 0; i < units_.size(); i++)
+    {
+      units_[i]->move(population.movedX[i], population.movedY[i]);
+    }
+    grid_.publish();
+  }
+
+  void melee() { grid_.handleMelee(); }
+
+  bool query(double x, double y)
+  {
+    const SnapshotGrid::Snapshot* snapshot = grid_.acquireSnapshot();
+    bool found = snapshot->findAt(x, y) != NULL;
+    grid_.releaseSnapshot(snapshot);
+    return found;
+  }
+
+private:
+  SnapshotGrid::Grid grid_;
+  std::vector<SnapshotGrid::Unit*> units_;
+};
+
+// The grid owns the units, so building it doesn't allocate per unit.
+class Pooled
+{
+public:
+  static const char* name() { return "pooled grid"; }
+
+  static double pairs(const Population& population)
+  {
+    return meleePairs(population, PooledGrid::CELL_SIZE);
+  }
+
+  void build(const Population& population)
+  {
+    for (size_t i = 0; i < population.x.size(); i++)
+    {
+      units_.push_back(grid_.create(population.x[i], population.y[i]));
+    }
+  }
+
+  void move(const Population& population)
+  {
+    for (size_t i = 0; i < units_.size(); i++)
+    {
+      grid_.move(units_[i], population.movedX[i], population.movedY[i]);
+    }
+  }
+
+  void melee() { grid_.handleMelee(); }
+
+  bool query(double x, double y)
+  {
+    return grid_.findAt(x, y) != PooledGrid::NO_UNIT;
+  }
+
+private:
+  PooledGrid::Grid grid_;
+  std::vector<PooledGrid::UnitHandle> units_;
+};
+
+void printTime(double nanoseconds, double count)
+{
+  if (nanoseconds < 0)
+  {
+    printf("  %12s", "skipped");
+  }
+  else
+  {
+    printf("  %12.2f", nanoseconds / count);
+  }
+}
+
+template <class Partition>
+void run(const Population& population)
+{
+  double numUnits = (double)population.x.size();
+
+  // Heap allocate since some partitions are too big for the stack.
+  Partition* partition = new Partition();
+
+  startProfile();
+  partition->build(population);
+  double build = endProfile();
+
+  startProfile();
+  partition->move(population);
+  double move = endProfile();
+
+  double melee = -1;
+  if (Partition::pairs(population) <= MAX_MELEE_PAIRS)
+  {
+    startProfile();
+    partition->melee();
+    melee = endProfile();
+  }
+
+  // Some queries are linear scans, so do fewer of them on big inputs.
+  int numQueries = numUnits > 100000 ? NUM_QUERIES / 10 : NUM_QUERIES;
+
+  long found = 0;
+  startProfile();
+  for (int i = 0; i < numQueries; i++)
+  {
+    if (partition->query(population.queryX[i], population.queryY[i]))
+    {
+      found++;
+    }
+  }
+  double query = endProfile();
+  consume(found);
+
+  printf("%-10s %8d  %-14s", population.name, (int)numUnits,
+         Partition::name());
+  printTime(build, numUnits);
+  printTime(move, numUnits);
+  printTime(melee, numUnits);
+  printTime(query, numQueries);
+  printf("\n");
+
+  delete partition;
+}
+
+int main(int argc, const char * argv[])
+{
+  srand(1234);
+
+  printf("%-10s %8s  %-14s  %12s  %12s  %12s  %12s\n", "population",
+         "units", "partition", "build ns/u", "move ns/u", "melee ns/u",
+         "query ns/q");
+
+  const char* populations[] = { "uniform", "clustered", "moving" };
+  const int sizes[] = { 1000, 10000, 100000, 1000000 };
+
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      Population population;
+      generate(population, populations[i], sizes[j]);
+
+      run<Naive>(population);
+      run<Fixed>(population);
+      run<Snapshot>(population);
+      run<Pooled>(population);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,156 @@
+// Measures EventQueue::SpscRing::RingBuffer from cpp/event-queue.h between
+// two threads, each pinned to its own core where the platform allows it,
+// against the same ring behind a mutex. Build with optimizations, e.g.:
+//
+//     c++ -std=c++11 -O2 -pthread main.cpp -o spsc_ring
+
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+
+#include "../shared/utils.h"
+#include "../../cpp/common.h"
+#include "../../cpp/event-queue.h"
+
+using namespace EventQueue;
+
+static const int NUM_MESSAGES = 5000000;
+static const int NUM_ROUND_TRIPS = 100000;
+static const int CAPACITY = 1024;
+
+typedef SpscRing::RingBuffer<PlayMessage, CAPACITY> SpscQueue;
+
+// Pins the calling thread to [core], wrapping around if there are fewer.
+void pin(int core)
+{
+#if defined(__linux__)
+  int numCores = (int)std::thread::hardware_concurrency();
+  if (numCores < 1) return;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core % numCores, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// The plain ring from the book with a lock around it, for comparison.
+class LockedRing
+{
+public:
+  LockedRing()
+  : head_(0),
+    tail_(0)
+  {}
+
+  bool tryPush(const PlayMessage& message)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if ((tail_ + 1) % CAPACITY == head_) return false;
+    items_[tail_] = message;
+    tail_ = (tail_ + 1) % CAPACITY;
+    return true;
+  }
+
+  bool tryPop(PlayMessage& message)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (head_ == tail_) return false;
+    message = items_[head_];
+    head_ = (head_ + 1) % CAPACITY;
+    return true;
+  }
+
+private:
+  std::mutex mutex_;
+  PlayMessage items_[CAPACITY];
+  int head_;
+  int tail_;
+};
+
+// Spinning without yielding would starve the other thread when both end up
+// on one core.
+template <class Queue>
+void push(Queue& queue, const PlayMessage& message)
+{
+  while (!queue.tryPush(message)) std::this_thread::yield();
+}
+
+template <class Queue>
+PlayMessage pop(Queue& queue)
+{
+  PlayMessage message;
+  while (!queue.tryPop(message)) std::this_thread::yield();
+  return message;
+}
+
+// Returns millions of messages per second streamed from one thread to the
+// other.
+template <class Queue>
+double throughput()
+{
+  Queue queue;
+
+  startProfile();
+  std::thread producer([&]() {
+    pin(1);
+    for (int i = 0; i < NUM_MESSAGES; i++)
+    {
+      PlayMessage message = { i, 1 };
+      push(queue, message);
+    }
+  });
+
+  long sum = 0;
+  for (int i = 0; i < NUM_MESSAGES; i++) sum += pop(queue).id;
+  producer.join();
+  double elapsed = endProfile();
+  consume(sum);
+
+  return NUM_MESSAGES * 1000.0 / elapsed;
+}
+
+// Bounces one message back and forth and returns half the average round
+// trip in nanoseconds.
+template <class Queue>
+double latency()
+{
+  Queue ping;
+  Queue pong;
+
+  std::thread echo([&]() {
+    pin(1);
+    for (int i = 0; i < NUM_ROUND_TRIPS; i++) push(pong, pop(ping));
+  });
+
+  long sum = 0;
+  startProfile();
+  for (int i = 0; i < NUM_ROUND_TRIPS; i++)
+  {
+    PlayMessage message = { i, 1 };
+    push(ping, message);
+    sum += pop(pong).id;
+  }
+  double elapsed = endProfile();
+  echo.join();
+  consume(sum);
+
+  return elapsed / NUM_ROUND_TRIPS / 2;
+}
+
+int main(int argc, const char * argv[])
+{
+  pin(0);
+
+  printf("%-8s  %12s  %12s\n", "queue", "Mmsgs/s", "latency ns");
+  printf("%-8s  %12.2f  %12.1f\n", "spsc", throughput<SpscQueue>(),
+         latency<SpscQueue>());
+  printf("%-8s  %12.2f  %12.1f\n", "locked", throughput<LockedRing>(),
+         latency<LockedRing>());
+
+  return 0;
+}
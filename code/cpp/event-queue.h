@@ -1,6 +1,43 @@
 #ifndef cpp_event_queue_h
 #define cpp_event_queue_h
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Timestamps queued messages and tracks how long they wait. Shipping builds
+// define this to 0 to compile all of that out.
+#ifndef QUEUE_STATS
+#define QUEUE_STATS 1
+#endif
+
+#include "expect.h"
+
 namespace EventQueue
 {
   typedef int ResourceId;
@@ -374,5 +411,2777 @@ namespace EventQueue
       int numMessages_;
     };
   }
+
+  namespace SpscRing
+  {
+    // A fixed-size queue that one thread pushes to while one other thread
+    // pops from it, with no locks. CAPACITY must be a power of two. The head
+    // and tail only ever count up and are masked down to an index, so every
+    // slot can be used and full and empty are told apart by their
+    // difference.
+    template <class T, int CAPACITY>
+    class RingBuffer
+    {
+    public:
+      RingBuffer()
+      : head_(0),
+        cachedTail_(0),
+        tail_(0),
+        cachedHead_(0),
+        items_()
+      {}
+
+      // Producer only. Returns false if the ring is full.
+      bool tryPush(const T& item)
+      {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cachedHead_ == (uint32_t)CAPACITY)
+        {
+          // Only look at the consumer's index when our last copy of it says
+          // we're full. That keeps its cache line from bouncing over here on
+          // every push.
+          cachedHead_ = head_.load(std::memory_order_acquire);
+          if (tail - cachedHead_ == (uint32_t)CAPACITY) return false;
+        }
+
+        items_[tail & MASK] = item;
+
+        // Release so the consumer sees the item once it sees the new tail.
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+      }
+
+      // Consumer only. Returns the oldest item without removing it, or NULL
+      // if the ring is empty.
+      T* front()
+      {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        if (head == cachedTail_)
+        {
+          cachedTail_ = tail_.load(std::memory_order_acquire);
+          if (head == cachedTail_) return NULL;
+        }
+
+        return &items_[head & MASK];
+      }
+
+      // Consumer only. Removes the item front() returned.
+      void pop()
+      {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+
+        // Release so the producer doesn't overwrite the slot before we're
+        // done reading it.
+        head_.store(head + 1, std::memory_order_release);
+      }
+
+      // Consumer only. Returns false if the ring is empty.
+      bool tryPop(T& item)
+      {
+        T* next = front();
+        if (next == NULL) return false;
+
+        item = *next;
+        pop();
+        return true;
+      }
+
+      // Safe from either thread, but only a snapshot.
+      int size() const
+      {
+        return (int)(tail_.load(std::memory_order_acquire) -
+                     head_.load(std::memory_order_acquire));
+      }
+
+      int capacity() const { return CAPACITY; }
+
+    private:
+      static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0,
+                    "Capacity must be a power of two.");
+
+      static const uint32_t MASK = CAPACITY - 1;
+
+      RingBuffer(const RingBuffer&);
+      RingBuffer& operator=(const RingBuffer&);
+
+      // Each side writes its own index and keeps a private copy of the
+      // other's. Both live on their own cache line so the two threads don't
+      // contend for one.
+      alignas(64) std::atomic<uint32_t> head_;
+      uint32_t cachedTail_;
+
+      alignas(64) std::atomic<uint32_t> tail_;
+      uint32_t cachedHead_;
+
+      alignas(64) T items_[CAPACITY];
+    };
+
+    // Ring::Audio, but playSound() can be called on the game thread while
+    // update() runs on the audio thread.
+    class Audio
+    {
+    public:
+      // Returns false and drops the request if the queue is full.
+      bool playSound(SoundId id, int volume)
+      {
+        PlayMessage message;
+        message.id = id;
+        message.volume = volume;
+        return pending_.tryPush(message);
+      }
+
+      void update()
+      {
+        // If there are no pending requests, do nothing.
+        PlayMessage* message = pending_.front();
+        if (message == NULL) return;
+
+        ResourceId resource = loadSound(message->id);
+        int channel = findOpenChannel();
+        if (channel == -1) return;
+        startSound(resource, channel, message->volume);
+
+        pending_.pop();
+      }
+
+      int numPending() const { return pending_.size(); }
+
+    private:
+      static const int MAX_PENDING = 16;
+
+      RingBuffer<PlayMessage, MAX_PENDING> pending_;
+    };
+
+    void test()
+    {
+      RingBuffer<int, 4> ring;
+      int item = -1;
+      EXPECT(!ring.tryPop(item));
+
+      // Every slot is usable.
+      EXPECT(ring.tryPush(1));
+      EXPECT(ring.tryPush(2));
+      EXPECT(ring.tryPush(3));
+      EXPECT(ring.tryPush(4));
+      EXPECT(!ring.tryPush(5));
+      EXPECT(ring.size() == 4);
+
+      EXPECT(ring.tryPop(item));
+      EXPECT(item == 1);
+
+      // Wraps around.
+      EXPECT(ring.tryPush(5));
+      EXPECT(*ring.front() == 2);
+
+      int sum = 0;
+      while (ring.tryPop(item)) sum += item;
+      EXPECT(sum == 2 + 3 + 4 + 5);
+      EXPECT(ring.size() == 0);
+
+      // Everything gets through in order when the two ends are on different
+      // threads.
+      static const int NUM_ITEMS = 100000;
+      RingBuffer<int, 64> shared;
+      std::thread producer([&]() {
+        for (int i = 0; i < NUM_ITEMS; i++)
+        {
+          while (!shared.tryPush(i)) std::this_thread::yield();
+        }
+      });
+
+      bool inOrder = true;
+      for (int i = 0; i < NUM_ITEMS; i++)
+      {
+        int received;
+        while (!shared.tryPop(received)) std::this_thread::yield();
+        if (received != i) inOrder = false;
+      }
+      producer.join();
+      EXPECT(inOrder);
+
+      // Nothing gives us a channel, so requests stay queued until it fills
+      // up, and then it drops them instead of asserting.
+      Audio audio;
+      for (int i = 0; i < 16; i++) audio.playSound(SOUND_BLOOP, VOL_MAX);
+      EXPECT(!audio.playSound(SOUND_BLOOP, VOL_MAX));
+      audio.update();
+      EXPECT(audio.numPending() == 16);
+    }
+  }
+
+  namespace MpscQueue
+  {
+    // A fixed-size queue that any number of threads push to while one
+    // thread pops from it. Each slot has a sequence number that says whose
+    // turn it is: it equals the position a producer may write it at, then
+    // one past that once the item is there for the consumer, then the
+    // position one lap later once the consumer has read it.
+    template <class T, int CAPACITY>
+    class Queue
+    {
+    public:
+      Queue()
+      : head_(0),
+        tail_(0)
+      {
+        for (int i = 0; i < CAPACITY; i++)
+        {
+          slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+      }
+
+      // Any thread. Claims the next position with a single fetch-add, so
+      // producers never retry against each other. If the queue is full, it
+      // waits for the consumer to free the claimed slot.
+      void push(const T& item)
+      {
+        uint32_t position = tail_.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots_[position & MASK];
+        while (slot.sequence.load(std::memory_order_acquire) != position)
+        {
+          std::this_thread::yield();
+        }
+
+        publish(slot, position, item);
+      }
+
+      // Any thread. Returns false instead of waiting if the queue is full. A
+      // position is only claimed once its slot is known to be free, which
+      // takes a compare-and-swap instead of a fetch-add.
+      bool tryPush(const T& item)
+      {
+        uint32_t position = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+          Slot& slot = slots_[position & MASK];
+          uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+          int32_t lag = (int32_t)(sequence - position);
+
+          if (lag == 0)
+          {
+            if (tail_.compare_exchange_weak(position, position + 1,
+                                            std::memory_order_relaxed))
+            {
+              publish(slot, position, item);
+              return true;
+            }
+
+            // Another producer got it and position now holds the new tail.
+          }
+          else if (lag < 0)
+          {
+            // The slot still holds an item from the last lap.
+            return false;
+          }
+          else
+          {
+            // Another producer claimed it since we read the tail.
+            position = tail_.load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+      // Consumer only. Returns false if the queue is empty, or if the next
+      // producer in line has claimed its slot but not finished writing it.
+      bool tryPop(T& item)
+      {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        Slot& slot = slots_[head & MASK];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+        {
+          return false;
+        }
+
+        item = slot.item;
+
+        // Hand the slot to whoever claims it on the next lap.
+        slot.sequence.store(head + CAPACITY, std::memory_order_release);
+        head_.store(head + 1, std::memory_order_relaxed);
+        return true;
+      }
+
+      // Consumer only. Pops up to [max] items into [items] and returns how
+      // many it got.
+      int popBatch(T* items, int max)
+      {
+        int count = 0;
+        while (count < max && tryPop(items[count])) count++;
+        return count;
+      }
+
+      // Safe from any thread, but only a snapshot. Producers that have
+      // claimed a slot count even if they haven't written it yet.
+      int size() const
+      {
+        int size = (int)(tail_.load(std::memory_order_relaxed) -
+                         head_.load(std::memory_order_relaxed));
+        if (size < 0) return 0;
+        if (size > CAPACITY) return CAPACITY;
+        return size;
+      }
+
+      int capacity() const { return CAPACITY; }
+
+    private:
+      static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0,
+                    "Capacity must be a power of two.");
+
+      static const uint32_t MASK = CAPACITY - 1;
+
+      struct Slot
+      {
+        std::atomic<uint32_t> sequence;
+        T item;
+      };
+
+      void publish(Slot& slot, uint32_t position, const T& item)
+      {
+        slot.item = item;
+
+        // Release so the consumer sees the item once it sees the sequence.
+        slot.sequence.store(position + 1, std::memory_order_release);
+      }
+
+      Queue(const Queue&);
+      Queue& operator=(const Queue&);
+
+      // The consumer's index and the producers' shared one are on separate
+      // cache lines.
+      alignas(64) std::atomic<uint32_t> head_;
+      alignas(64) std::atomic<uint32_t> tail_;
+      alignas(64) Slot slots_[CAPACITY];
+    };
+
+    // Physics, AI and UI jobs can all call playSound() at once.
+    class Audio
+    {
+    public:
+      // Returns false and drops the request if the queue is full.
+      bool playSound(SoundId id, int volume)
+      {
+        PlayMessage message;
+        message.id = id;
+        message.volume = volume;
+        return pending_.tryPush(message);
+      }
+
+      // Starts everything that was pending when it was called. Requests
+      // that can't get a channel are dropped.
+      void update()
+      {
+        PlayMessage batch[MAX_PENDING];
+        int count = pending_.popBatch(batch, MAX_PENDING);
+        for (int i = 0; i < count; i++)
+        {
+          ResourceId resource = loadSound(batch[i].id);
+          int channel = findOpenChannel();
+          if (channel == -1) continue;
+          startSound(resource, channel, batch[i].volume);
+        }
+      }
+
+      int numPending() const { return pending_.size(); }
+
+    private:
+      static const int MAX_PENDING = 64;
+
+      Queue<PlayMessage, MAX_PENDING> pending_;
+    };
+
+    void test()
+    {
+      Queue<int, 4> queue;
+      int item = -1;
+      EXPECT(!queue.tryPop(item));
+
+      EXPECT(queue.tryPush(1));
+      EXPECT(queue.tryPush(2));
+      queue.push(3);
+      queue.push(4);
+      EXPECT(!queue.tryPush(5));
+      EXPECT(queue.size() == 4);
+
+      EXPECT(queue.tryPop(item));
+      EXPECT(item == 1);
+      EXPECT(queue.tryPush(5));
+
+      int batch[8];
+      EXPECT(queue.popBatch(batch, 8) == 4);
+      EXPECT(batch[0] == 2 && batch[3] == 5);
+      EXPECT(queue.size() == 0);
+
+      // Items from each producer arrive in the order it pushed them. Half
+      // the producers wait when the queue is full and half retry.
+      static const int NUM_PRODUCERS = 4;
+      static const int ITEMS_PER_PRODUCER = 20000;
+      Queue<int, 64> shared;
+
+      std::thread producers[NUM_PRODUCERS];
+      for (int p = 0; p < NUM_PRODUCERS; p++)
+      {
+        producers[p] = std::thread([&shared, p]() {
+          for (int i = 0; i < ITEMS_PER_PRODUCER; i++)
+          {
+            int value = p * ITEMS_PER_PRODUCER + i;
+            if (p % 2 == 0)
+            {
+              shared.push(value);
+            }
+            else
+            {
+              while (!shared.tryPush(value)) std::this_thread::yield();
+            }
+          }
+        });
+      }
+
+      int next[NUM_PRODUCERS] = { 0 };
+      bool inOrder = true;
+      for (int received = 0; received < NUM_PRODUCERS * ITEMS_PER_PRODUCER;)
+      {
+        int count = shared.popBatch(batch, 8);
+        if (count == 0) std::this_thread::yield();
+
+        for (int i = 0; i < count; i++)
+        {
+          int p = batch[i] / ITEMS_PER_PRODUCER;
+          if (batch[i] % ITEMS_PER_PRODUCER != next[p]) inOrder = false;
+          next[p]++;
+        }
+        received += count;
+      }
+
+      for (int p = 0; p < NUM_PRODUCERS; p++) producers[p].join();
+      EXPECT(inOrder);
+      EXPECT(shared.size() == 0);
+
+      Audio audio;
+      EXPECT(audio.playSound(SOUND_BLOOP, VOL_MAX));
+      EXPECT(audio.numPending() == 1);
+      audio.update();
+      EXPECT(audio.numPending() == 0);
+    }
+  }
+
+  namespace AudioThread
+  {
+    // Owns a thread that plays requested sounds, so the blocking
+    // loadSound() never runs on the game thread. The thread drains the
+    // queue in batches and sleeps while it's empty.
+    class Audio
+    {
+    public:
+      Audio()
+      : sleeping_(false),
+        quit_(false),
+        numHandled_(0),
+        numWakeups_(0)
+      {
+        thread_ = std::thread(&Audio::run, this);
+      }
+
+      // Plays whatever is still queued before stopping the thread.
+      ~Audio()
+      {
+        quit_.store(true);
+        wake();
+        thread_.join();
+      }
+
+      // Safe from any thread. Returns false and drops the request if the
+      // queue is full. Usually this is just the enqueue: the audio thread
+      // is only signaled if it's asleep.
+      bool playSound(SoundId id, int volume)
+      {
+        PlayMessage message;
+        message.id = id;
+        message.volume = volume;
+        if (!pending_.tryPush(message)) return false;
+
+        // Pairs with the fence in run(). Either we see that the audio thread
+        // is going to sleep, or it sees the message we just pushed.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed)) wake();
+        return true;
+      }
+
+      // How many requests the audio thread has finished with.
+      int numHandled() const { return numHandled_.load(); }
+
+      // How many times playSound() had to wake the audio thread.
+      int numWakeups() const { return numWakeups_.load(); }
+
+    private:
+      static const int MAX_PENDING = 256;
+      static const int BATCH_SIZE = 32;
+
+      void run()
+      {
+        PlayMessage batch[BATCH_SIZE];
+        for (;;)
+        {
+          int count = pending_.popBatch(batch, BATCH_SIZE);
+          for (int i = 0; i < count; i++)
+          {
+            ResourceId resource = loadSound(batch[i].id);
+            int channel = findOpenChannel();
+            if (channel != -1) startSound(resource, channel, batch[i].volume);
+          }
+
+          if (count > 0)
+          {
+            numHandled_.fetch_add(count);
+            continue;
+          }
+
+          // Say we're going to sleep before the last look at the queue, so a
+          // request pushed after that look is sure to wake us.
+          std::unique_lock<std::mutex> lock(mutex_);
+          sleeping_.store(true, std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+
+          while (pending_.size() == 0 && !quit_.load())
+          {
+            wakeUp_.wait(lock);
+          }
+
+          sleeping_.store(false, std::memory_order_relaxed);
+          if (pending_.size() == 0 && quit_.load()) return;
+        }
+      }
+
+      void wake()
+      {
+        // Taking the lock means the audio thread is either waiting or hasn't
+        // checked the queue yet, so the notify can't be lost.
+        std::lock_guard<std::mutex> lock(mutex_);
+        numWakeups_.fetch_add(1);
+        wakeUp_.notify_one();
+      }
+
+      Audio(const Audio&);
+      Audio& operator=(const Audio&);
+
+      MpscQueue::Queue<PlayMessage, MAX_PENDING> pending_;
+
+      std::thread thread_;
+      std::mutex mutex_;
+      std::condition_variable wakeUp_;
+      std::atomic<bool> sleeping_;
+      std::atomic<bool> quit_;
+
+      std::atomic<int> numHandled_;
+      std::atomic<int> numWakeups_;
+    };
+
+    void test()
+    {
+      static const int NUM_SOUNDS = 10000;
+
+      int numPlayed = 0;
+      {
+        Audio audio;
+        for (int i = 0; i < NUM_SOUNDS; i++)
+        {
+          while (!audio.playSound(SOUND_BLOOP, VOL_MAX))
+          {
+            std::this_thread::yield();
+          }
+          numPlayed++;
+        }
+
+        while (audio.numHandled() < numPlayed) std::this_thread::yield();
+        EXPECT(audio.numHandled() == NUM_SOUNDS);
+        EXPECT(audio.numWakeups() <= NUM_SOUNDS);
+
+        // Once it's drained, the thread sleeps until there's more to do.
+        EXPECT(audio.playSound(SOUND_BLOOP, VOL_MAX));
+        while (audio.numHandled() < NUM_SOUNDS + 1)
+        {
+          std::this_thread::yield();
+        }
+        EXPECT(audio.numHandled() == NUM_SOUNDS + 1);
+      }
+
+      // Shutting down with requests still queued doesn't lose or hang on
+      // them.
+      {
+        Audio audio;
+        for (int i = 0; i < 100; i++) audio.playSound(SOUND_BLOOP, VOL_MAX);
+      }
+    }
+  }
+
+  namespace Coalesced
+  {
+    // Policies for combining the volume of a request with the one already
+    // pending for the same sound.
+    struct MaxVolume
+    {
+      static int merge(int pending, int incoming)
+      {
+        return pending > incoming ? pending : incoming;
+      }
+    };
+
+    struct SumVolume
+    {
+      static int merge(int pending, int incoming)
+      {
+        return pending + incoming;
+      }
+    };
+
+    struct LatestVolume
+    {
+      static int merge(int, int incoming)
+      {
+        return incoming;
+      }
+    };
+
+    // Like Duplicate::Audio, but instead of walking every pending request
+    // to find one for the same sound, it keeps a small hash table from
+    // sound to ring slot. Finding a duplicate takes the same time no matter
+    // how many requests are queued.
+    template <class MergePolicy>
+    class Audio
+    {
+    public:
+      static const int MAX_PENDING = 64;
+
+      Audio()
+      : head_(0),
+        numPending_(0)
+      {
+        for (int i = 0; i < INDEX_SIZE; i++) index_[i] = EMPTY;
+      }
+
+      void playSound(SoundId id, int volume)
+      {
+        int slot = find(id);
+        if (slot != EMPTY)
+        {
+          pending_[slot].volume = MergePolicy::merge(pending_[slot].volume,
+                                                     volume);
+          return;
+        }
+
+        assert(numPending_ < MAX_PENDING);
+
+        slot = (head_ + numPending_) & MASK;
+        pending_[slot].id = id;
+        pending_[slot].volume = volume;
+        insert(slot);
+        numPending_++;
+      }
+
+      void update()
+      {
+        // If there are no pending requests, do nothing.
+        const PlayMessage* message = front();
+        if (message == NULL) return;
+
+        ResourceId resource = loadSound(message->id);
+        int channel = findOpenChannel();
+        if (channel == -1) return;
+        startSound(resource, channel, message->volume);
+
+        pop();
+      }
+
+      // The oldest pending request, or NULL if there are none.
+      const PlayMessage* front() const
+      {
+        if (numPending_ == 0) return NULL;
+        return &pending_[head_];
+      }
+
+      // Removes the oldest pending request. Requests for its sound after
+      // this are queued again instead of merged.
+      void pop()
+      {
+        assert(numPending_ > 0);
+
+        remove(head_);
+        head_ = (head_ + 1) & MASK;
+        numPending_--;
+      }
+
+      int numPending() const { return numPending_; }
+
+    private:
+      static const int MASK = MAX_PENDING - 1;
+
+      // Keeping the table at most half full keeps probe sequences short.
+      static const int INDEX_BITS = 7;
+      static const int INDEX_SIZE = 1 << INDEX_BITS;
+      static const int INDEX_MASK = INDEX_SIZE - 1;
+      static_assert(INDEX_SIZE >= MAX_PENDING * 2,
+                    "The index must have room for twice MAX_PENDING.");
+      static const int EMPTY = -1;
+
+      static int home(SoundId id)
+      {
+        // Fibonacci hashing spreads out sequential IDs. The top bits of the
+        // product are the best mixed, so those pick the bucket.
+        return (int)(((uint32_t)id * 2654435769u) >> (32 - INDEX_BITS));
+      }
+
+      // Returns the ring slot of the request for [id], or EMPTY.
+      int find(SoundId id) const
+      {
+        for (int i = home(id); index_[i] != EMPTY; i = (i + 1) & INDEX_MASK)
+        {
+          if (pending_[index_[i]].id == id) return index_[i];
+        }
+
+        return EMPTY;
+      }
+
+      void insert(int slot)
+      {
+        int i = home(pending_[slot].id);
+        while (index_[i] != EMPTY) i = (i + 1) & INDEX_MASK;
+        index_[i] = slot;
+      }
+
+      void remove(int slot)
+      {
+        int hole = home(pending_[slot].id);
+        while (index_[hole] != slot) hole = (hole + 1) & INDEX_MASK;
+
+        // Instead of leaving a tombstone, pull back any later entry in the
+        // same run that would still be found from the hole's position.
+        for (int i = (hole + 1) & INDEX_MASK; index_[i] != EMPTY;
+             i = (i + 1) & INDEX_MASK)
+        {
+          int entryHome = home(pending_[index_[i]].id);
+          if (((i - entryHome) & INDEX_MASK) >= ((i - hole) & INDEX_MASK))
+          {
+            index_[hole] = index_[i];
+            hole = i;
+          }
+        }
+
+        index_[hole] = EMPTY;
+      }
+
+      PlayMessage pending_[MAX_PENDING];
+      int head_;
+      int numPending_;
+
+      int index_[INDEX_SIZE];
+    };
+
+    void test()
+    {
+      Audio<MaxVolume> maxAudio;
+      maxAudio.playSound(1, 3);
+      maxAudio.playSound(2, 5);
+      maxAudio.playSound(1, 7);
+      maxAudio.playSound(1, 4);
+      EXPECT(maxAudio.numPending() == 2);
+      EXPECT(maxAudio.front()->volume == 7);
+
+      Audio<SumVolume> sumAudio;
+      sumAudio.playSound(1, 3);
+      sumAudio.playSound(1, 4);
+      EXPECT(sumAudio.front()->volume == 7);
+
+      Audio<LatestVolume> latestAudio;
+      latestAudio.playSound(1, 3);
+      latestAudio.playSound(1, 4);
+      EXPECT(latestAudio.front()->volume == 4);
+
+      // Once a request is handled, the next one for the same sound is new.
+      latestAudio.pop();
+      latestAudio.playSound(1, 2);
+      EXPECT(latestAudio.numPending() == 1);
+      EXPECT(latestAudio.front()->volume == 2);
+
+      // Check a long random run against merging with a linear scan.
+      static const int MAX_PENDING = Audio<SumVolume>::MAX_PENDING;
+      Audio<SumVolume> audio;
+      PlayMessage expected[MAX_PENDING];
+      int numExpected = 0;
+      bool matches = true;
+
+      srand(2718);
+      for (int i = 0; i < 20000; i++)
+      {
+        bool full = numExpected == MAX_PENDING;
+        if (numExpected > 0 && (full || rand() % 3 == 0))
+        {
+          if (audio.front()->id != expected[0].id ||
+              audio.front()->volume != expected[0].volume)
+          {
+            matches = false;
+          }
+
+          audio.pop();
+          numExpected--;
+          for (int j = 0; j < numExpected; j++) expected[j] = expected[j + 1];
+          continue;
+        }
+
+        // Spread IDs out so they collide in the table now and then.
+        SoundId id = (rand() % 100) * 37;
+        int volume = rand() % 10;
+        audio.playSound(id, volume);
+
+        bool merged = false;
+        for (int j = 0; j < numExpected; j++)
+        {
+          if (expected[j].id == id)
+          {
+            expected[j].volume += volume;
+            merged = true;
+            break;
+          }
+        }
+
+        if (!merged)
+        {
+          expected[numExpected].id = id;
+          expected[numExpected].volume = volume;
+          numExpected++;
+        }
+
+        if (audio.numPending() != numExpected) matches = false;
+      }
+
+      EXPECT(matches);
+    }
+  }
+
+  namespace Prioritized
+  {
+    // Higher priorities are always handled first.
+    enum Priority
+    {
+      PRIORITY_CRITICAL,
+      PRIORITY_UI,
+      PRIORITY_NORMAL,
+      PRIORITY_AMBIENT,
+
+      NUM_PRIORITIES
+    };
+
+    // Times are in microseconds on whatever clock the game passes to
+    // update().
+    static const int64_t NO_DEADLINE = -1;
+
+    struct TimedMessage
+    {
+      SoundId id;
+      int volume;
+      int64_t deadline;
+    };
+
+    // How much work one call to update() may do. Dropping a stale request
+    // counts against maxMessages just like playing one.
+    struct Budget
+    {
+      int maxMessages;
+      int64_t maxMicroseconds;
+    };
+
+    // Keeps a ring per priority so a burst of footsteps can't hold up
+    // dialogue. Requests that wait past their deadline are thrown away
+    // instead of played late.
+    class Audio
+    {
+    public:
+      Audio()
+      : numPlayed_(0),
+        numExpired_(0)
+      {}
+
+      // Returns false and drops the request if its priority's queue is
+      // full.
+      bool playSound(SoundId id, int volume, Priority priority,
+                     int64_t deadline = NO_DEADLINE)
+      {
+        TimedMessage message;
+        message.id = id;
+        message.volume = volume;
+        message.deadline = deadline;
+        return pending_[priority].tryPush(message);
+      }
+
+      // Handles pending requests, highest priority first, until they run
+      // out or the budget does. At least one request is looked at, so the
+      // queue always makes progress.
+      void update(int64_t now, const Budget& budget)
+      {
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+
+        for (int count = 0; count < budget.maxMessages; count++)
+        {
+          if (count > 0 && budget.maxMicroseconds >= 0)
+          {
+            int64_t elapsed = (int64_t)std::chrono::duration_cast<
+                std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            if (elapsed >= budget.maxMicroseconds) return;
+          }
+
+          RingType* queue = highestPending();
+          if (queue == NULL) return;
+
+          TimedMessage* message = queue->front();
+          if (message->deadline != NO_DEADLINE && now > message->deadline)
+          {
+            queue->pop();
+            numExpired_++;
+            continue;
+          }
+
+          ResourceId resource = loadSound(message->id);
+          int channel = findOpenChannel();
+
+          // Try again next frame rather than play something lower priority
+          // ahead of it.
+          if (channel == -1) return;
+          startSound(resource, channel, message->volume);
+
+          queue->pop();
+          numPlayed_++;
+        }
+      }
+
+      int numPending(Priority priority) const
+      {
+        return pending_[priority].size();
+      }
+      int numPlayed() const { return numPlayed_; }
+      int numExpired() const { return numExpired_; }
+
+    private:
+      static const int MAX_PENDING = 64;
+
+      typedef SpscRing::RingBuffer<TimedMessage, MAX_PENDING> RingType;
+
+      RingType* highestPending()
+      {
+        for (int i = 0; i < NUM_PRIORITIES; i++)
+        {
+          if (pending_[i].front() != NULL) return &pending_[i];
+        }
+
+        return NULL;
+      }
+
+      RingType pending_[NUM_PRIORITIES];
+      int numPlayed_;
+      int numExpired_;
+    };
+
+    void test()
+    {
+      Audio audio;
+      Budget unlimited = { 1000, -1 };
+
+      // Nothing gives us a channel, so only expired requests get removed.
+      audio.playSound(1, VOL_MAX, PRIORITY_AMBIENT, 100);
+      audio.playSound(2, VOL_MAX, PRIORITY_CRITICAL);
+      audio.update(50, unlimited);
+      EXPECT(audio.numPending(PRIORITY_CRITICAL) == 1);
+      EXPECT(audio.numPending(PRIORITY_AMBIENT) == 1);
+      EXPECT(audio.numExpired() == 0);
+
+      // The critical request is stuck waiting for a channel, so the ambient
+      // one isn't even looked at.
+      audio.update(200, unlimited);
+      EXPECT(audio.numPending(PRIORITY_AMBIENT) == 1);
+      EXPECT(audio.numExpired() == 0);
+
+      // Stale requests are dropped without being played, up to the budget.
+      Audio stale;
+      for (int i = 0; i < 10; i++)
+      {
+        stale.playSound(i, VOL_MAX, PRIORITY_NORMAL, 100);
+      }
+
+      Budget fewMessages = { 4, -1 };
+      stale.update(200, fewMessages);
+      EXPECT(stale.numExpired() == 4);
+      EXPECT(stale.numPending(PRIORITY_NORMAL) == 6);
+
+      // A time budget that's already used up still handles one.
+      Budget noTime = { 1000, 0 };
+      stale.update(200, noTime);
+      EXPECT(stale.numExpired() == 5);
+
+      stale.update(200, unlimited);
+      EXPECT(stale.numExpired() == 10);
+      EXPECT(stale.numPlayed() == 0);
+    }
+  }
+
+  namespace EventBus
+  {
+    typedef int EventType;
+
+    // Each event struct gets its own small number the first time it's used.
+    inline EventType nextTypeId()
+    {
+      static std::atomic<int> next(0);
+      return next.fetch_add(1);
+    }
+
+    template <class TEvent>
+    EventType typeId()
+    {
+      static EventType id = nextTypeId();
+      return id;
+    }
+
+    // One thread publishes events of any plain-old-data struct type that
+    // fits in MAX_EVENT_SIZE bytes. Another thread calls drain(), which
+    // hands each subscriber all of the pending events of its type as one
+    // array, so it can handle them in a tight loop. Events of one type
+    // arrive in the order they were published, but not interleaved with
+    // other types.
+    template <int MAX_EVENT_SIZE, int CAPACITY>
+    class Bus
+    {
+    public:
+      Bus()
+      : numUnhandled_(0)
+      {}
+
+      // Producer only. Returns false and drops the event if the bus is
+      // full.
+      template <class TEvent>
+      bool publish(const TEvent& event)
+      {
+        static_assert(sizeof(TEvent) <= MAX_EVENT_SIZE,
+                      "Event is too big for the bus.");
+        static_assert(std::is_trivially_copyable<TEvent>::value,
+                      "Events are copied as raw bytes.");
+
+        // The staging buffers handlers read from are only aligned this far.
+        static_assert(alignof(TEvent) <= alignof(std::max_align_t),
+                      "Event is over-aligned for the bus.");
+
+        Envelope envelope;
+        envelope.type = typeId<TEvent>();
+        memcpy(envelope.payload, &event, sizeof(TEvent));
+        return queue_.tryPush(envelope);
+      }
+
+      // Consumer only. [handler] is called with the events and how many
+      // there are.
+      template <class TEvent>
+      void subscribe(const std::function<void(const TEvent*, int)>& handler)
+      {
+        EventType type = typeId<TEvent>();
+        if (type >= (int)types_.size()) types_.resize(type + 1);
+
+        Subscribers& subscribers = types_[type];
+        subscribers.size = sizeof(TEvent);
+        subscribers.handlers.push_back([handler](const void* events,
+                                                 int count) {
+          handler(static_cast<const TEvent*>(events), count);
+        });
+      }
+
+      // Consumer only. Delivers everything published so far.
+      void drain()
+      {
+        // Sort the events into a contiguous array per type first.
+        Envelope* envelope;
+        while ((envelope = queue_.front()) != NULL)
+        {
+          EventType type = envelope->type;
+          if (type < (int)types_.size() && !types_[type].handlers.empty())
+          {
+            Subscribers& subscribers = types_[type];
+            if (subscribers.count == 0) active_.push_back(type);
+
+            size_t offset = subscribers.count * subscribers.size;
+            if (subscribers.staged.size() < offset + subscribers.size)
+            {
+              subscribers.staged.resize((offset + subscribers.size) * 2);
+            }
+
+            memcpy(&subscribers.staged[offset], envelope->payload,
+                   subscribers.size);
+            subscribers.count++;
+          }
+          else
+          {
+            numUnhandled_++;
+          }
+
+          queue_.pop();
+        }
+
+        // Then dispatch them a type at a time.
+        for (size_t i = 0; i < active_.size(); i++)
+        {
+          Subscribers& subscribers = types_[active_[i]];
+          for (size_t j = 0; j < subscribers.handlers.size(); j++)
+          {
+            subscribers.handlers[j](&subscribers.staged[0],
+                                    subscribers.count);
+          }
+
+          subscribers.count = 0;
+        }
+
+        active_.clear();
+      }
+
+      // How many events were thrown away because nothing subscribed to
+      // their type.
+      int numUnhandled() const { return numUnhandled_; }
+
+    private:
+      struct Envelope
+      {
+        EventType type;
+
+        // Aligned so any event can be copied in and out of it.
+        alignas(std::max_align_t) unsigned char payload[MAX_EVENT_SIZE];
+      };
+
+      struct Subscribers
+      {
+        Subscribers()
+        : size(0),
+          count(0)
+        {}
+
+        size_t size;
+        std::vector<std::function<void(const void*, int)> > handlers;
+
+        // The events drained so far, back to back. A vector's buffer is
+        // aligned for any fundamental type, so it can be read as an array of
+        // events.
+        std::vector<unsigned char> staged;
+        int count;
+      };
+
+      SpscRing::RingBuffer<Envelope, CAPACITY> queue_;
+
+      // Indexed by type ID.
+      std::vector<Subscribers> types_;
+
+      // The types that have staged events in the current drain.
+      std::vector<EventType> active_;
+
+      int numUnhandled_;
+    };
+
+    struct Explosion
+    {
+      double x, y;
+      int radius;
+    };
+
+    struct Unsubscribed
+    {
+      int value;
+    };
+
+    void test()
+    {
+      Bus<32, 256> bus;
+
+      int numSoundBatches = 0;
+      int numSounds = 0;
+      int volume = 0;
+      bus.subscribe<PlayMessage>([&](const PlayMessage* sounds, int count) {
+        numSoundBatches++;
+        numSounds += count;
+        for (int i = 0; i < count; i++) volume += sounds[i].volume;
+      });
+
+      int numExplosionBatches = 0;
+      bool inOrder = true;
+      bus.subscribe<Explosion>([&](const Explosion* explosions, int count) {
+        numExplosionBatches++;
+        for (int i = 0; i < count; i++)
+        {
+          if (explosions[i].radius != i) inOrder = false;
+        }
+      });
+
+      for (int i = 0; i < 10; i++)
+      {
+        PlayMessage sound = { SOUND_BLOOP, i };
+        EXPECT(bus.publish(sound));
+
+        Explosion explosion = { 1.0, 2.0, i };
+        EXPECT(bus.publish(explosion));
+      }
+
+      Unsubscribed unsubscribed = { 3 };
+      bus.publish(unsubscribed);
+
+      bus.drain();
+      EXPECT(numSoundBatches == 1);
+      EXPECT(numSounds == 10);
+      EXPECT(volume == 45);
+      EXPECT(numExplosionBatches == 1);
+      EXPECT(inOrder);
+      EXPECT(bus.numUnhandled() == 1);
+
+      // Handlers aren't called for types with nothing pending.
+      PlayMessage sound = { SOUND_BLOOP, 1 };
+      bus.publish(sound);
+      bus.drain();
+      EXPECT(numSoundBatches == 2);
+      EXPECT(numExplosionBatches == 1);
+    }
+  }
+
+  namespace SoundCache
+  {
+    struct SoundBuffer
+    {
+      SoundId id;
+
+      // Empty if the file couldn't be read.
+      std::vector<char> data;
+    };
+
+    // Keeps recently played sounds in memory, up to a byte budget, and
+    // loads the rest on a background thread. The game's audio code asks for
+    // a sound with find() and never waits: if it isn't loaded yet, find()
+    // returns NULL and the load happens in the background.
+    //
+    // Sounds are read from files named by their ID in [directory]. All
+    // methods except the constructor and destructor are for the single
+    // thread that plays sounds.
+    class Cache
+    {
+    public:
+      Cache(const std::string& directory, size_t byteBudget)
+      : directory_(directory),
+        byteBudget_(byteBudget),
+        numBytes_(0),
+        sleeping_(false),
+        quit_(false)
+      {
+        loader_ = std::thread(&Cache::load, this);
+      }
+
+      ~Cache()
+      {
+        quit_.store(true);
+        wake();
+        loader_.join();
+
+        // Anything the loader finished that update() never picked up.
+        SoundBuffer* buffer;
+        while (completed_.tryPop(buffer)) delete buffer;
+
+        std::unordered_map<SoundId, Entry>::iterator it;
+        for (it = entries_.begin(); it != entries_.end(); ++it)
+        {
+          delete it->second.buffer;
+        }
+      }
+
+      enum State
+      {
+        STATE_LOADING,
+        STATE_READY,
+        STATE_FAILED
+      };
+
+      // Returns [id]'s buffer if it's loaded and marks it as the most
+      // recently used. Otherwise, starts loading it if that hasn't started
+      // yet and returns NULL. If [state] isn't NULL, it's set to whether the
+      // sound is ready, still loading, or failed to load. A failure is only
+      // reported once. After that the sound is forgotten, and the next find()
+      // tries loading it again.
+      const SoundBuffer* find(SoundId id, State* state = NULL)
+      {
+        std::unordered_map<SoundId, Entry>::iterator found =
+            entries_.find(id);
+        if (found == entries_.end())
+        {
+          // If the loader is too far behind to take the request, act like
+          // it's in flight and ask again next time.
+          if (state != NULL) *state = STATE_LOADING;
+          if (!requests_.tryPush(id)) return NULL;
+
+          // Pairs with the fence in load(). Either we see that the loader is
+          // going to sleep, or it sees the request we just pushed.
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          if (sleeping_.load(std::memory_order_relaxed)) wake();
+
+          Entry entry;
+          entry.state = STATE_LOADING;
+          entry.buffer = NULL;
+          entries_[id] = entry;
+          return NULL;
+        }
+
+        Entry& entry = found->second;
+        if (state != NULL) *state = entry.state;
+
+        if (entry.state == STATE_FAILED)
+        {
+          entries_.erase(found);
+          return NULL;
+        }
+
+        if (entry.state != STATE_READY) return NULL;
+
+        lru_.splice(lru_.begin(), lru_, entry.lruPosition);
+        return entry.buffer;
+      }
+
+      // Takes in the sounds the loader has finished and evicts the least
+      // recently used ones to get back under budget. A buffer returned by
+      // find() stays valid until the next call to this.
+      void update()
+      {
+        SoundBuffer* buffer;
+        while (completed_.tryPop(buffer))
+        {
+          Entry& entry = entries_[buffer->id];
+          if (buffer->data.empty())
+          {
+            entry.state = STATE_FAILED;
+            delete buffer;
+            continue;
+          }
+
+          entry.state = STATE_READY;
+          entry.buffer = buffer;
+          lru_.push_front(buffer->id);
+          entry.lruPosition = lru_.begin();
+          numBytes_ += buffer->data.size();
+        }
+
+        // Always keep the newest sound, even if it alone is over budget.
+        while (numBytes_ > byteBudget_ && lru_.size() > 1)
+        {
+          std::unordered_map<SoundId, Entry>::iterator victim =
+              entries_.find(lru_.back());
+          numBytes_ -= victim->second.buffer->data.size();
+          delete victim->second.buffer;
+          entries_.erase(victim);
+          lru_.pop_back();
+        }
+      }
+
+      size_t numBytes() const { return numBytes_; }
+
+    private:
+      static const int MAX_REQUESTS = 64;
+
+      struct Entry
+      {
+        State state;
+        SoundBuffer* buffer;
+        std::list<SoundId>::iterator lruPosition;
+      };
+
+      // Runs on the loader thread.
+      void load()
+      {
+        SoundId id;
+        for (;;)
+        {
+          if (!requests_.tryPop(id))
+          {
+            // Say we're going to sleep before the last look at the queue, so
+            // a request pushed after that look is sure to wake us.
+            std::unique_lock<std::mutex> lock(mutex_);
+            sleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            while (requests_.size() == 0 && !quit_.load())
+            {
+              wakeUp_.wait(lock);
+            }
+
+            sleeping_.store(false, std::memory_order_relaxed);
+            if (quit_.load()) return;
+            continue;
+          }
+
+          SoundBuffer* buffer = new SoundBuffer();
+          buffer->id = id;
+          readFile(id, buffer->data);
+
+          while (!completed_.tryPush(buffer))
+          {
+            if (quit_.load())
+            {
+              delete buffer;
+              return;
+            }
+
+            std::this_thread::yield();
+          }
+        }
+      }
+
+      void wake()
+      {
+        // Taking the lock means the loader is either waiting or hasn't
+        // checked the queue yet, so the notify can't be lost. This only
+        // happens when the loader is idle, so the lock is never contended
+        // for long.
+        std::lock_guard<std::mutex> lock(mutex_);
+        wakeUp_.notify_one();
+      }
+
+      void readFile(SoundId id, std::vector<char>& data)
+      {
+        char name[16];
+        snprintf(name, sizeof(name), "%d", id);
+        std::string path = directory_ + "/" + name;
+
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == NULL) return;
+
+        char chunk[4096];
+        size_t size;
+        while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        {
+          data.insert(data.end(), chunk, chunk + size);
+        }
+
+        fclose(file);
+      }
+
+      Cache(const Cache&);
+      Cache& operator=(const Cache&);
+
+      std::string directory_;
+      size_t byteBudget_;
+      size_t numBytes_;
+
+      std::unordered_map<SoundId, Entry> entries_;
+
+      // Most recently used first.
+      std::list<SoundId> lru_;
+
+      SpscRing::RingBuffer<SoundId, MAX_REQUESTS> requests_;
+      SpscRing::RingBuffer<SoundBuffer*, MAX_REQUESTS> completed_;
+
+      std::thread loader_;
+      std::mutex mutex_;
+      std::condition_variable wakeUp_;
+      std::atomic<bool> sleeping_;
+      std::atomic<bool> quit_;
+    };
+
+    // Plays sounds out of a Cache. A request for a sound that isn't loaded
+    // yet is held, without holding up the ones behind it, until its sound
+    // is ready.
+    class Audio
+    {
+    public:
+      Audio(Cache& cache)
+      : cache_(cache),
+        numFailed_(0)
+      {}
+
+      // Returns false and drops the request if the queue is full.
+      bool playSound(SoundId id, int volume)
+      {
+        PlayMessage message;
+        message.id = id;
+        message.volume = volume;
+        return pending_.tryPush(message);
+      }
+
+      void update()
+      {
+        cache_.update();
+
+        // Older held requests go first.
+        size_t numHeld = 0;
+        for (size_t i = 0; i < held_.size(); i++)
+        {
+          if (!tryPlay(held_[i])) held_[numHeld++] = held_[i];
+        }
+        held_.resize(numHeld);
+
+        PlayMessage message;
+        while (pending_.tryPop(message))
+        {
+          if (!tryPlay(message)) held_.push_back(message);
+        }
+      }
+
+      int numHeld() const { return (int)held_.size(); }
+
+      // Requests dropped because their sound couldn't be loaded.
+      int numFailed() const { return numFailed_; }
+
+    private:
+      static const int MAX_PENDING = 64;
+
+      // Returns false if the sound is still loading.
+      bool tryPlay(const PlayMessage& message)
+      {
+        Cache::State state;
+        const SoundBuffer* buffer = cache_.find(message.id, &state);
+        if (state == Cache::STATE_LOADING) return false;
+
+        if (state == Cache::STATE_FAILED)
+        {
+          numFailed_++;
+          return true;
+        }
+
+        use(buffer);
+        int channel = findOpenChannel();
+        if (channel != -1) startSound(message.id, channel, message.volume);
+        return true;
+      }
+
+      Cache& cache_;
+      SpscRing::RingBuffer<PlayMessage, MAX_PENDING> pending_;
+      std::vector<PlayMessage> held_;
+      int numFailed_;
+    };
+
+#if defined(__unix__) || defined(__APPLE__)
+    void writeSound(const std::string& directory, SoundId id, int size)
+    {
+      char name[16];
+      snprintf(name, sizeof(name), "%d", id);
+      std::string path = directory + "/" + name;
+
+      std::vector<char> data(size, (char)id);
+      FILE* file = fopen(path.c_str(), "wb");
+      fwrite(&data[0], 1, data.size(), file);
+      fclose(file);
+    }
+
+    void removeSound(const std::string& directory, SoundId id)
+    {
+      char name[16];
+      snprintf(name, sizeof(name), "%d", id);
+      unlink((directory + "/" + name).c_str());
+    }
+
+    // Keeps calling update() until [cache] has finished loading [id].
+    const SoundBuffer* waitFor(Cache& cache, SoundId id)
+    {
+      for (int i = 0; i < 5000; i++)
+      {
+        cache.update();
+
+        Cache::State state;
+        const SoundBuffer* buffer = cache.find(id, &state);
+        if (state != Cache::STATE_LOADING) return buffer;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+
+      return NULL;
+    }
+
+    void test()
+    {
+      char directoryName[] = "/tmp/gpp-sounds-XXXXXX";
+      if (mkdtemp(directoryName) == NULL) return;
+      std::string directory = directoryName;
+
+      writeSound(directory, 1, 100);
+      writeSound(directory, 2, 100);
+      writeSound(directory, 3, 100);
+
+      {
+        Cache cache(directory, 250);
+
+        // The first ask only starts the load.
+        EXPECT(cache.find(1) == NULL);
+        const SoundBuffer* buffer = waitFor(cache, 1);
+        EXPECT(buffer != NULL && buffer->data.size() == 100);
+        EXPECT(buffer != NULL && buffer->data[0] == 1);
+
+        EXPECT(waitFor(cache, 2) != NULL);
+        EXPECT(cache.numBytes() == 200);
+
+        // Touch 1 so that 2 is the least recently used when 3 comes in.
+        cache.find(1);
+        EXPECT(waitFor(cache, 3) != NULL);
+        EXPECT(cache.numBytes() == 200);
+
+        Cache::State state;
+        EXPECT(cache.find(1, &state) != NULL);
+        EXPECT(cache.find(2, &state) == NULL);
+        EXPECT(state == Cache::STATE_LOADING);
+
+        // A failed sound is reported once and then forgotten, so it can
+        // load once its file shows up.
+        EXPECT(waitFor(cache, 9) == NULL);
+        writeSound(directory, 9, 50);
+        EXPECT(cache.find(9, &state) == NULL);
+        EXPECT(state == Cache::STATE_LOADING);
+        EXPECT(waitFor(cache, 9) != NULL);
+        removeSound(directory, 9);
+      }
+
+      {
+        Cache cache(directory, 1000);
+        Audio audio(cache);
+
+        // Neither sound is loaded, so both requests wait. The one that can't
+        // be loaded is dropped once that's known.
+        audio.playSound(2, VOL_MAX);
+        audio.playSound(9, VOL_MAX);
+        audio.update();
+        EXPECT(audio.numHeld() == 2);
+
+        for (int i = 0; i < 5000 && audio.numHeld() > 0; i++)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          audio.update();
+        }
+
+        EXPECT(audio.numHeld() == 0);
+        EXPECT(audio.numFailed() == 1);
+      }
+
+      removeSound(directory, 1);
+      removeSound(directory, 2);
+      removeSound(directory, 3);
+      rmdir(directoryName);
+    }
+#endif
+  }
+
+  namespace Channels
+  {
+    using Prioritized::Priority;
+    using Prioritized::PRIORITY_CRITICAL;
+    using Prioritized::PRIORITY_UI;
+    using Prioritized::PRIORITY_NORMAL;
+    using Prioritized::PRIORITY_AMBIENT;
+    using Prioritized::NUM_PRIORITIES;
+
+    // Hands out hardware channels. Free channels are bits in a mask, so
+    // finding one is a single bit scan. When they're all busy, it steals the
+    // voice that matters least: the lowest priority playing, and the oldest
+    // of those. A voice is never stolen for a less important one.
+    class ChannelManager
+    {
+    public:
+      static const int MAX_CHANNELS = 64;
+
+      ChannelManager(int numChannels)
+      : numChannels_(numChannels),
+        freeMask_(0),
+        nextAge_(0),
+        numStolen_(0),
+        numDropped_(0)
+      {
+        assert(numChannels > 0 && numChannels <= MAX_CHANNELS);
+
+        for (int i = 0; i < numChannels; i++) freeMask_ |= bit(i);
+        for (int i = 0; i < NUM_PRIORITIES; i++) busyMasks_[i] = 0;
+      }
+
+      // Returns the channel to play a sound of [priority] on, or -1 if every
+      // channel is playing something more important.
+      int allocate(Priority priority)
+      {
+        int channel;
+        if (freeMask_ != 0)
+        {
+          channel = __builtin_ctzll(freeMask_);
+          freeMask_ &= freeMask_ - 1;
+        }
+        else
+        {
+          channel = findVictim(priority);
+          if (channel == -1)
+          {
+            numDropped_++;
+            return -1;
+          }
+
+          busyMasks_[priorities_[channel]] &= ~bit(channel);
+          numStolen_++;
+        }
+
+        priorities_[channel] = priority;
+        ages_[channel] = nextAge_++;
+        busyMasks_[priority] |= bit(channel);
+        return channel;
+      }
+
+      // Call when the sound on [channel] finishes.
+      void release(int channel)
+      {
+        assert(channel >= 0 && channel < numChannels_);
+        assert((freeMask_ & bit(channel)) == 0);
+
+        busyMasks_[priorities_[channel]] &= ~bit(channel);
+        freeMask_ |= bit(channel);
+      }
+
+      int numFree() const { return __builtin_popcountll(freeMask_); }
+      int numStolen() const { return numStolen_; }
+      int numDropped() const { return numDropped_; }
+
+    private:
+      static uint64_t bit(int channel) { return (uint64_t)1 << channel; }
+
+      int findVictim(Priority priority)
+      {
+        // Only the least important busy priority needs looking at, and
+        // walking its mask touches just the channels playing at it.
+        for (int level = NUM_PRIORITIES - 1; level >= priority; level--)
+        {
+          uint64_t busy = busyMasks_[level];
+          if (busy == 0) continue;
+
+          int oldest = -1;
+          while (busy != 0)
+          {
+            int channel = __builtin_ctzll(busy);
+            busy &= busy - 1;
+            if (oldest == -1 || ages_[channel] < ages_[oldest])
+            {
+              oldest = channel;
+            }
+          }
+
+          return oldest;
+        }
+
+        return -1;
+      }
+
+      int numChannels_;
+      uint64_t freeMask_;
+
+      // Which channels are playing at each priority.
+      uint64_t busyMasks_[NUM_PRIORITIES];
+
+      Priority priorities_[MAX_CHANNELS];
+      uint64_t ages_[MAX_CHANNELS];
+      uint64_t nextAge_;
+
+      int numStolen_;
+      int numDropped_;
+    };
+
+    // Every pending request is either started or dropped on each update,
+    // so a burst of sounds never stalls the queue.
+    class Audio
+    {
+    public:
+      Audio(int numChannels)
+      : channels_(numChannels)
+      {}
+
+      // Returns false and drops the request if the queue is full.
+      bool playSound(SoundId id, int volume, Priority priority)
+      {
+        Request request;
+        request.id = id;
+        request.volume = volume;
+        request.priority = priority;
+        return pending_.tryPush(request);
+      }
+
+      void update()
+      {
+        Request request;
+        while (pending_.tryPop(request))
+        {
+          int channel = channels_.allocate(request.priority);
+          if (channel == -1) continue;
+
+          ResourceId resource = loadSound(request.id);
+          startSound(resource, channel, request.volume);
+        }
+      }
+
+      // Called by the mixer when a channel's sound ends.
+      void onSoundFinished(int channel) { channels_.release(channel); }
+
+      const ChannelManager& channels() const { return channels_; }
+
+    private:
+      static const int MAX_PENDING = 64;
+
+      struct Request
+      {
+        SoundId id;
+        int volume;
+        Priority priority;
+      };
+
+      ChannelManager channels_;
+      SpscRing::RingBuffer<Request, MAX_PENDING> pending_;
+    };
+
+    void test()
+    {
+      ChannelManager channels(4);
+      EXPECT(channels.allocate(PRIORITY_NORMAL) == 0);
+      EXPECT(channels.allocate(PRIORITY_AMBIENT) == 1);
+      EXPECT(channels.allocate(PRIORITY_NORMAL) == 2);
+      EXPECT(channels.allocate(PRIORITY_AMBIENT) == 3);
+      EXPECT(channels.numFree() == 0);
+
+      // Steals the oldest of the least important voices.
+      EXPECT(channels.allocate(PRIORITY_NORMAL) == 1);
+      EXPECT(channels.allocate(PRIORITY_NORMAL) == 3);
+      EXPECT(channels.numStolen() == 2);
+
+      // All normal now, so an ambient sound can't steal, but another normal
+      // one takes the oldest.
+      EXPECT(channels.allocate(PRIORITY_AMBIENT) == -1);
+      EXPECT(channels.numDropped() == 1);
+      EXPECT(channels.allocate(PRIORITY_NORMAL) == 0);
+      EXPECT(channels.allocate(PRIORITY_CRITICAL) == 2);
+      EXPECT(channels.numStolen() == 4);
+
+      // Released channels are used before stealing.
+      channels.release(3);
+      EXPECT(channels.numFree() == 1);
+      EXPECT(channels.allocate(PRIORITY_AMBIENT) == 3);
+      EXPECT(channels.numStolen() == 4);
+
+      // A burst bigger than the channel count is handled in one update.
+      Audio audio(8);
+      for (int i = 0; i < 20; i++) audio.playSound(i, VOL_MAX, PRIORITY_UI);
+      audio.playSound(99, VOL_MAX, PRIORITY_AMBIENT);
+      audio.update();
+      EXPECT(audio.channels().numStolen() == 12);
+      EXPECT(audio.channels().numDropped() == 1);
+
+      audio.onSoundFinished(5);
+      EXPECT(audio.channels().numFree() == 1);
+    }
+  }
+
+  namespace Instrumented
+  {
+    // Monotonic time in nanoseconds.
+    inline uint64_t now()
+    {
+      return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Counts latencies in buckets that are an eighth of a power of two
+    // wide, so any percentile it reports is within 12.5% of the real one.
+    class LatencyHistogram
+    {
+    public:
+      LatencyHistogram() { reset(); }
+
+      void record(uint64_t nanoseconds)
+      {
+        buckets_[bucket(nanoseconds)]++;
+        count_++;
+        if (nanoseconds > max_) max_ = nanoseconds;
+      }
+
+      // Returns the latency that [fraction] of the recorded ones are at or
+      // under, rounded up to the top of its bucket.
+      uint64_t percentile(double fraction) const
+      {
+        if (count_ == 0) return 0;
+
+        uint64_t target = (uint64_t)(fraction * count_ + 0.999999);
+        if (target < 1) target = 1;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++)
+        {
+          seen += buckets_[i];
+          if (seen >= target)
+          {
+            uint64_t top = bucketLow(i + 1) - 1;
+            return top < max_ ? top : max_;
+          }
+        }
+
+        return max_;
+      }
+
+      uint64_t max() const { return max_; }
+      int count() const { return (int)count_; }
+
+      void reset()
+      {
+        for (int i = 0; i < NUM_BUCKETS; i++) buckets_[i] = 0;
+        count_ = 0;
+        max_ = 0;
+      }
+
+      static int bucket(uint64_t value)
+      {
+        if (value < 8) return (int)value;
+
+        int topBit = 63 - __builtin_clzll(value);
+        int fraction = (int)(value >> (topBit - 3)) & 7;
+        return (topBit - 2) * 8 + fraction;
+      }
+
+      // The smallest value that lands in [bucket].
+      static uint64_t bucketLow(int bucket)
+      {
+        if (bucket < 8) return (uint64_t)bucket;
+
+        int topBit = bucket / 8 + 2;
+        if (topBit > 63) return ~(uint64_t)0;
+        return (uint64_t)(8 + bucket % 8) << (topBit - 3);
+      }
+
+    private:
+      static const int NUM_BUCKETS = 62 * 8;
+
+      uint32_t buckets_[NUM_BUCKETS];
+      uint64_t count_;
+      uint64_t max_;
+    };
+
+    struct FrameStats
+    {
+      int frame;
+
+      // Messages handled this frame and how long they waited in the queue,
+      // in nanoseconds. All zero when QUEUE_STATS is off.
+      int numHandled;
+      uint64_t p50;
+      uint64_t p99;
+      uint64_t max;
+
+      // The most messages that were queued at once this frame.
+      int depthHighWater;
+    };
+
+    // Ring::Audio with its queue measured. update() handles everything
+    // that's pending and endFrame() returns what it saw.
+    class Audio
+    {
+    public:
+      Audio()
+      : head_(0),
+        numPending_(0),
+        frame_(0),
+        depthHighWater_(0)
+      {}
+
+      // Returns false and drops the request if the queue is full.
+      bool playSound(SoundId id, int volume)
+      {
+        if (numPending_ == MAX_PENDING) return false;
+
+        Message& message = pending_[(head_ + numPending_) % MAX_PENDING];
+        message.id = id;
+        message.volume = volume;
+#if QUEUE_STATS
+        message.enqueuedAt = now();
+#endif
+
+        numPending_++;
+#if QUEUE_STATS
+        if (numPending_ > depthHighWater_) depthHighWater_ = numPending_;
+#endif
+        return true;
+      }
+
+      void update()
+      {
+        while (numPending_ > 0)
+        {
+          Message& message = pending_[head_];
+#if QUEUE_STATS
+          latencies_.record(now() - message.enqueuedAt);
+#endif
+
+          ResourceId resource = loadSound(message.id);
+          int channel = findOpenChannel();
+          if (channel != -1) startSound(resource, channel, message.volume);
+
+          head_ = (head_ + 1) % MAX_PENDING;
+          numPending_--;
+        }
+      }
+
+      // Returns the stats for the frame that just finished and starts
+      // counting a new one.
+      FrameStats endFrame()
+      {
+        FrameStats stats;
+        stats.frame = frame_++;
+#if QUEUE_STATS
+        stats.numHandled = latencies_.count();
+        stats.p50 = latencies_.percentile(0.5);
+        stats.p99 = latencies_.percentile(0.99);
+        stats.max = latencies_.max();
+        stats.depthHighWater = depthHighWater_;
+
+        latencies_.reset();
+        depthHighWater_ = numPending_;
+#else
+        stats.numHandled = 0;
+        stats.p50 = 0;
+        stats.p99 = 0;
+        stats.max = 0;
+        stats.depthHighWater = 0;
+#endif
+        return stats;
+      }
+
+      // Prints a line with [stats].
+      static void dump(const FrameStats& stats);
+
+    private:
+      static const int MAX_PENDING = 64;
+
+      struct Message
+      {
+        SoundId id;
+        int volume;
+#if QUEUE_STATS
+        uint64_t enqueuedAt;
+#endif
+      };
+
+      Message pending_[MAX_PENDING];
+      int head_;
+      int numPending_;
+
+      int frame_;
+      int depthHighWater_;
+#if QUEUE_STATS
+      LatencyHistogram latencies_;
+#endif
+    };
+
+    void Audio::dump(const FrameStats& stats)
+    {
+      printf("audio frame %d: %d handled, latency p50 %lluns p99 %lluns "
+             "max %lluns, %d deep\n", stats.frame, stats.numHandled,
+             (unsigned long long)stats.p50, (unsigned long long)stats.p99,
+             (unsigned long long)stats.max, stats.depthHighWater);
+    }
+
+    void test()
+    {
+      // Bucket boundaries line up.
+      EXPECT(LatencyHistogram::bucket(7) == 7);
+      EXPECT(LatencyHistogram::bucket(8) == 8);
+      EXPECT(LatencyHistogram::bucket(15) == 15);
+      EXPECT(LatencyHistogram::bucket(16) == 16);
+      EXPECT(LatencyHistogram::bucket(17) == 16);
+      EXPECT(LatencyHistogram::bucketLow(LatencyHistogram::bucket(1000)) <=
+             1000);
+      EXPECT(LatencyHistogram::bucketLow(LatencyHistogram::bucket(1000) + 1) >
+             1000);
+
+      LatencyHistogram histogram;
+      for (int i = 1; i <= 100; i++) histogram.record(i * 1000);
+      EXPECT(histogram.count() == 100);
+      EXPECT(histogram.max() == 100000);
+
+      // Within a bucket's width of the real value.
+      uint64_t p50 = histogram.percentile(0.5);
+      EXPECT(p50 >= 50000 && p50 <= 50000 * 9 / 8);
+      uint64_t p99 = histogram.percentile(0.99);
+      EXPECT(p99 >= 99000 && p99 <= 100000);
+
+      Audio audio;
+      for (int i = 0; i < 10; i++) audio.playSound(SOUND_BLOOP, VOL_MAX);
+      audio.update();
+      audio.playSound(SOUND_BLOOP, VOL_MAX);
+      audio.update();
+
+      FrameStats stats = audio.endFrame();
+      EXPECT(stats.frame == 0);
+#if QUEUE_STATS
+      EXPECT(stats.numHandled == 11);
+      EXPECT(stats.depthHighWater == 10);
+      EXPECT(stats.p50 <= stats.p99 && stats.p99 <= stats.max);
+#endif
+
+      // Each frame starts over.
+      stats = audio.endFrame();
+      EXPECT(stats.frame == 1);
+      EXPECT(stats.numHandled == 0);
+      EXPECT(stats.depthHighWater == 0);
+    }
+  }
+
+#if defined(__unix__) || defined(__APPLE__)
+  namespace Replay
+  {
+    // The log file starts with this, followed by records back to back.
+    struct LogHeader
+    {
+      char magic[4];
+      uint32_t version;
+
+      // Lets the replayer reject a log written for a different message.
+      uint32_t recordSize;
+
+      // The frames recording started and stopped on. Replay covers all of
+      // them even if the first or last few had no messages. endFrame is
+      // NO_END_FRAME if the recorder never closed the log.
+      uint32_t firstFrame;
+      uint32_t endFrame;
+      uint32_t reserved;
+    };
+
+    static const uint32_t NO_END_FRAME = 0xffffffff;
+
+    template <class TMessage>
+    struct Record
+    {
+      uint32_t frame;
+      uint32_t reserved;
+
+      // Instrumented::now() when it was recorded.
+      uint64_t timestamp;
+
+      TMessage message;
+    };
+
+    static const char LOG_MAGIC[4] = { 'E', 'V', 'Q', 'L' };
+    static const uint32_t LOG_VERSION = 2;
+
+    // Appends every message it's given to a log file. The thread that calls
+    // record() only copies the message into a ring. A writer thread takes
+    // them from there and does the file I/O in batches.
+    template <class TMessage>
+    class Recorder
+    {
+    public:
+      Recorder(const char* path, int firstFrame)
+      : endFrame_(firstFrame),
+        quit_(false),
+        numStalls_(0)
+      {
+        file_ = fopen(path, "wb");
+        if (file_ == NULL) return;
+
+        LogHeader header;
+        memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+        header.version = LOG_VERSION;
+        header.recordSize = sizeof(Record<TMessage>);
+        header.firstFrame = (uint32_t)firstFrame;
+        header.endFrame = NO_END_FRAME;
+        header.reserved = 0;
+        fwrite(&header, sizeof(header), 1, file_);
+
+        writer_ = std::thread(&Recorder::write, this);
+      }
+
+      // Writes out everything recorded so far and where the session ended
+      // before closing the file.
+      ~Recorder()
+      {
+        if (file_ == NULL) return;
+
+        quit_.store(true);
+        writer_.join();
+
+        uint32_t endFrame = (uint32_t)endFrame_;
+        fseek(file_, offsetof(LogHeader, endFrame), SEEK_SET);
+        fwrite(&endFrame, sizeof(endFrame), 1, file_);
+        fclose(file_);
+      }
+
+      bool isOpen() const { return file_ != NULL; }
+
+      // Call from the recording thread when [frame] is over, whether or not
+      // it had any messages.
+      void endFrame(int frame) { endFrame_ = frame + 1; }
+
+      // Only one thread may record. If the writer has fallen a whole ring
+      // behind, this waits for it rather than lose a message.
+      void record(int frame, const TMessage& message)
+      {
+        if (file_ == NULL) return;
+
+        Record<TMessage> record;
+        record.frame = (uint32_t)frame;
+        record.reserved = 0;
+        record.timestamp = Instrumented::now();
+        record.message = message;
+
+        if (records_.tryPush(record)) return;
+
+        numStalls_++;
+        while (!records_.tryPush(record)) std::this_thread::yield();
+      }
+
+      // How many times record() had to wait for the writer.
+      int numStalls() const { return numStalls_; }
+
+    private:
+      static const int MAX_QUEUED = 4096;
+      static const int BATCH_SIZE = 256;
+
+      // Runs on the writer thread.
+      void write()
+      {
+        Record<TMessage> batch[BATCH_SIZE];
+        for (;;)
+        {
+          // Check before draining, so nothing recorded before the
+          // destructor set it is left behind.
+          bool quit = quit_.load();
+
+          int count = 0;
+          while (count < BATCH_SIZE && records_.tryPop(batch[count])) count++;
+
+          if (count > 0)
+          {
+            fwrite(batch, sizeof(Record<TMessage>), count, file_);
+            continue;
+          }
+
+          if (quit) return;
+
+          fflush(file_);
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+
+      Recorder(const Recorder&);
+      Recorder& operator=(const Recorder&);
+
+      FILE* file_;
+      int endFrame_;
+      SpscRing::RingBuffer<Record<TMessage>, MAX_QUEUED> records_;
+      std::thread writer_;
+      std::atomic<bool> quit_;
+      int numStalls_;
+    };
+
+    // Maps a log into memory and feeds its messages back into a consumer.
+    template <class TMessage>
+    class Replayer
+    {
+    public:
+      Replayer(const char* path)
+      : data_(NULL),
+        size_(0),
+        records_(NULL),
+        numRecords_(0),
+        firstFrame_(0),
+        endFrame_(0)
+      {
+        int file = open(path, O_RDONLY);
+        if (file == -1) return;
+
+        struct stat info;
+        if (fstat(file, &info) == 0 &&
+            info.st_size >= (off_t)sizeof(LogHeader))
+        {
+          size_ = (size_t)info.st_size;
+          void* data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, file, 0);
+          if (data != MAP_FAILED) data_ = static_cast<const char*>(data);
+        }
+
+        close(file);
+        if (data_ == NULL) return;
+
+        const LogHeader* header = reinterpret_cast<const LogHeader*>(data_);
+        if (memcmp(header->magic, LOG_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != LOG_VERSION ||
+            header->recordSize != sizeof(Record<TMessage>))
+        {
+          return;
+        }
+
+        records_ = reinterpret_cast<const Record<TMessage>*>(
+            data_ + sizeof(LogHeader));
+        firstFrame_ = header->firstFrame;
+
+        // A record cut off by a crash is ignored.
+        numRecords_ = (int)((size_ - sizeof(LogHeader)) /
+                            sizeof(Record<TMessage>));
+
+        // If the recorder never closed the log, the best we know is that it
+        // ran through the frame of its last message.
+        endFrame_ = header->endFrame;
+        if (endFrame_ == NO_END_FRAME)
+        {
+          endFrame_ = numRecords_ > 0 ?
+              records_[numRecords_ - 1].frame + 1 : firstFrame_;
+        }
+      }
+
+      ~Replayer()
+      {
+        if (data_ != NULL) munmap(const_cast<char*>(data_), size_);
+      }
+
+      // False if the file couldn't be read or was written for a different
+      // message type.
+      bool isValid() const { return records_ != NULL; }
+
+      int numRecords() const { return numRecords_; }
+      const Record<TMessage>& record(int index) const
+      {
+        return records_[index];
+      }
+
+      // Sends every message to [consumer.replay()], as fast as it can take
+      // them, and calls [consumer.update()] at the end of each recorded
+      // frame, including ones that had no messages. For a log whose recorder
+      // closed it, the consumer goes through the same sequence of calls it
+      // did when the log was recorded.
+      template <class Consumer>
+      void replay(Consumer& consumer) const
+      {
+        if (records_ == NULL) return;
+
+        uint32_t frame = firstFrame_;
+        for (int i = 0; i < numRecords_; i++)
+        {
+          for (; frame < records_[i].frame; frame++) consumer.update();
+          consumer.replay(records_[i].message);
+        }
+
+        for (; frame < endFrame_; frame++) consumer.update();
+      }
+
+      int firstFrame() const { return (int)firstFrame_; }
+      int endFrame() const { return (int)endFrame_; }
+
+    private:
+      Replayer(const Replayer&);
+      Replayer& operator=(const Replayer&);
+
+      const char* data_;
+      size_t size_;
+      const Record<TMessage>* records_;
+      int numRecords_;
+      uint32_t firstFrame_;
+      uint32_t endFrame_;
+    };
+
+    // A queue whose traffic can be recorded and replayed. It keeps a
+    // running hash of what it handled so two runs can be compared.
+    class Audio
+    {
+    public:
+      Audio()
+      : recorder_(NULL),
+        frame_(0),
+        numHandled_(0),
+        hash_(0)
+      {}
+
+      // Starts sending every request to [recorder]. Pass NULL to stop.
+      void record(Recorder<PlayMessage>* recorder) { recorder_ = recorder; }
+
+      // Returns false and drops the request if the queue is full.
+      bool playSound(SoundId id, int volume)
+      {
+        PlayMessage message;
+        message.id = id;
+        message.volume = volume;
+        return replay(message);
+      }
+
+      bool replay(const PlayMessage& message)
+      {
+        if (!pending_.tryPush(message)) return false;
+        if (recorder_ != NULL) recorder_->record(frame_, message);
+        return true;
+      }
+
+      // Handles everything pending. Called once per frame.
+      void update()
+      {
+        PlayMessage message;
+        while (pending_.tryPop(message))
+        {
+          ResourceId resource = loadSound(message.id);
+          int channel = findOpenChannel();
+          if (channel != -1) startSound(resource, channel, message.volume);
+
+          numHandled_++;
+          hash_ = hash_ * 31 + (uint32_t)(frame_ * 7919 + message.id * 31 +
+                                          message.volume);
+        }
+
+        if (recorder_ != NULL) recorder_->endFrame(frame_);
+        frame_++;
+      }
+
+      int frame() const { return frame_; }
+      int numHandled() const { return numHandled_; }
+      uint32_t hash() const { return hash_; }
+
+    private:
+      static const int MAX_PENDING = 64;
+
+      SpscRing::RingBuffer<PlayMessage, MAX_PENDING> pending_;
+      Recorder<PlayMessage>* recorder_;
+      int frame_;
+      int numHandled_;
+      uint32_t hash_;
+    };
+
+    void test()
+    {
+      char path[] = "/tmp/gpp-replay-XXXXXX";
+      int file = mkstemp(path);
+      if (file == -1) return;
+      close(file);
+
+      Audio original;
+      {
+        Recorder<PlayMessage> recorder(path, original.frame());
+        EXPECT(recorder.isOpen());
+        original.record(&recorder);
+
+        // Some frames are empty and some are busy.
+        srand(31337);
+        for (int frame = 0; frame < 100; frame++)
+        {
+          int numSounds = frame % 5 == 0 ? 0 : rand() % 20;
+          for (int i = 0; i < numSounds; i++)
+          {
+            original.playSound(rand() % 50, rand() % 10);
+          }
+
+          original.update();
+        }
+
+        // A few quiet frames at the end still count.
+        for (int frame = 0; frame < 5; frame++) original.update();
+
+        original.record(NULL);
+      }
+
+      Replayer<PlayMessage> replayer(path);
+      EXPECT(replayer.isValid());
+      EXPECT(replayer.numRecords() == original.numHandled());
+      EXPECT(replayer.record(0).timestamp <=
+             replayer.record(replayer.numRecords() - 1).timestamp);
+
+      // The same requests arrive on the same frames.
+      Audio replayed;
+      replayer.replay(replayed);
+      EXPECT(replayed.numHandled() == original.numHandled());
+      EXPECT(replayed.hash() == original.hash());
+      EXPECT(replayed.frame() == original.frame());
+
+      // A log for some other message type is rejected.
+      Replayer<Record<PlayMessage> > wrongType(path);
+      EXPECT(!wrongType.isValid());
+
+      unlink(path);
+    }
+  }
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+  namespace SharedMemory
+  {
+    // The atomics below are shared between processes, which only works if
+    // they don't fall back to a lock inside the process.
+    static_assert(ATOMIC_INT_LOCK_FREE == 2,
+                  "Shared memory queue needs lock-free atomics.");
+
+    // A single-producer, single-consumer ring like SpscRing::RingBuffer,
+    // but kept in a named POSIX shared memory segment so that the producer
+    // and consumer can be in different processes. Each process maps the
+    // segment wherever it likes, so nothing in it is a pointer: items are
+    // found by index from the start of the segment.
+    //
+    // Pushing and popping are plain loads and stores. The only system call
+    // is a futex wake, and the producer only makes it when the consumer
+    // has gone to sleep waiting for items.
+    template <class T, int CAPACITY>
+    class Queue
+    {
+    public:
+      Queue()
+      : segment_(NULL),
+        cachedHead_(0),
+        cachedTail_(0)
+      {}
+
+      ~Queue()
+      {
+        if (segment_ != NULL) munmap(segment_, sizeof(Segment));
+      }
+
+      // Creates a new segment with [name], which should start with "/",
+      // replacing any old one. Returns false if it couldn't.
+      bool create(const char* name)
+      {
+        shm_unlink(name);
+        int file = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (file == -1) return false;
+
+        if (ftruncate(file, sizeof(Segment)) != 0 || !map(file))
+        {
+          close(file);
+          shm_unlink(name);
+          return false;
+        }
+
+        close(file);
+
+        // A fresh segment is all zeroes, so the indexes already start at
+        // zero. Write the header last so open() only accepts a finished one.
+        segment_->capacity = CAPACITY;
+        segment_->itemSize = sizeof(T);
+        segment_->magic.store(MAGIC, std::memory_order_release);
+        return true;
+      }
+
+      // Maps a segment another process created. Returns false if it doesn't
+      // exist or was made for a different queue.
+      bool open(const char* name)
+      {
+        int file = shm_open(name, O_RDWR, 0600);
+        if (file == -1) return false;
+
+        struct stat info;
+        bool mapped = fstat(file, &info) == 0 &&
+                      info.st_size == (off_t)sizeof(Segment) && map(file);
+        close(file);
+        if (!mapped) return false;
+
+        if (segment_->magic.load(std::memory_order_acquire) != MAGIC ||
+            segment_->capacity != CAPACITY ||
+            segment_->itemSize != sizeof(T))
+        {
+          munmap(segment_, sizeof(Segment));
+          segment_ = NULL;
+          return false;
+        }
+
+        cachedHead_ = segment_->head.load(std::memory_order_acquire);
+        cachedTail_ = segment_->tail.load(std::memory_order_acquire);
+        return true;
+      }
+
+      // Removes the name. Processes that have it mapped keep using it.
+      static void destroy(const char* name) { shm_unlink(name); }
+
+      bool isOpen() const { return segment_ != NULL; }
+
+      // Producer only. Returns false if the ring is full.
+      bool tryPush(const T& item)
+      {
+        uint32_t tail = segment_->tail.load(std::memory_order_relaxed);
+        if (tail - cachedHead_ == (uint32_t)CAPACITY)
+        {
+          cachedHead_ = segment_->head.load(std::memory_order_acquire);
+          if (tail - cachedHead_ == (uint32_t)CAPACITY) return false;
+        }
+
+        segment_->items[tail & MASK] = item;
+        segment_->tail.store(tail + 1, std::memory_order_release);
+
+        // Pairs with the fence in waitPop(). Either we see the consumer is
+        // asleep, or it sees the item we just pushed.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (segment_->sleeping.load(std::memory_order_relaxed) != 0)
+        {
+          segment_->wakeUps.fetch_add(1, std::memory_order_relaxed);
+          wake(&segment_->wakeUps);
+        }
+
+        return true;
+      }
+
+      // Consumer only. Returns false if the ring is empty.
+      bool tryPop(T& item)
+      {
+        uint32_t head = segment_->head.load(std::memory_order_relaxed);
+        if (head == cachedTail_)
+        {
+          cachedTail_ = segment_->tail.load(std::memory_order_acquire);
+          if (head == cachedTail_) return false;
+        }
+
+        item = segment_->items[head & MASK];
+        segment_->head.store(head + 1, std::memory_order_release);
+        return true;
+      }
+
+      // Consumer only. Like tryPop(), but if the ring is empty, sleeps until
+      // the producer pushes something or [timeoutMs] passes.
+      bool waitPop(T& item, int timeoutMs)
+      {
+        if (tryPop(item)) return true;
+
+        uint32_t wakeUps = segment_->wakeUps.load(std::memory_order_relaxed);
+        segment_->sleeping.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // Look once more now that the producer will see we're asleep.
+        bool popped = tryPop(item);
+        if (!popped)
+        {
+          wait(&segment_->wakeUps, wakeUps, timeoutMs);
+          popped = tryPop(item);
+        }
+
+        segment_->sleeping.store(0, std::memory_order_relaxed);
+        return popped;
+      }
+
+      // How many times the producer had to wake the consumer.
+      int numWakeUps() const { return (int)segment_->wakeUps.load(); }
+
+    private:
+      static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0,
+                    "Capacity must be a power of two.");
+      static_assert(std::is_trivially_copyable<T>::value,
+                    "Items are shared as raw memory.");
+
+      static const uint32_t MASK = CAPACITY - 1;
+      static const uint32_t MAGIC = 0x45565153;
+
+      // Everything in the shared segment.
+      struct Segment
+      {
+        std::atomic<uint32_t> magic;
+        uint32_t capacity;
+        uint32_t itemSize;
+
+        alignas(64) std::atomic<uint32_t> head;
+
+        alignas(64) std::atomic<uint32_t> tail;
+
+        // Set while the consumer is waiting. The producer bumps wakeUps and
+        // wakes anyone waiting on it.
+        std::atomic<uint32_t> sleeping;
+        std::atomic<uint32_t> wakeUps;
+
+        alignas(64) T items[CAPACITY];
+      };
+
+      bool map(int file)
+      {
+        void* memory = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, file, 0);
+        if (memory == MAP_FAILED) return false;
+
+        segment_ = static_cast<Segment*>(memory);
+        return true;
+      }
+
+#if defined(__linux__)
+      // Shared futexes, since the waiter may be in another process.
+      static void wait(std::atomic<uint32_t>* word, uint32_t value,
+                       int timeoutMs)
+      {
+        struct timespec timeout;
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT,
+                value, &timeout, NULL, 0);
+      }
+
+      static void wake(std::atomic<uint32_t>* word)
+      {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, 1,
+                NULL, NULL, 0);
+      }
+#else
+      // Without futexes, the consumer polls until the producer bumps the
+      // word or it times out.
+      static void wait(std::atomic<uint32_t>* word, uint32_t value,
+                       int timeoutMs)
+      {
+        for (int i = 0; i < timeoutMs && word->load() == value; i++)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+      }
+
+      static void wake(std::atomic<uint32_t>* word) {}
+#endif
+
+      Queue(const Queue&);
+      Queue& operator=(const Queue&);
+
+      Segment* segment_;
+
+      // Each side's private copy of the other side's index.
+      uint32_t cachedHead_;
+      uint32_t cachedTail_;
+    };
+
+    void test()
+    {
+      char name[32];
+      snprintf(name, sizeof(name), "/gpp-events-%d", (int)getpid());
+
+      // Two mappings of one segment stand in for the game and the sidecar
+      // process. They land at different addresses.
+      Queue<PlayMessage, 64> game;
+      if (!game.create(name)) return;
+
+      Queue<PlayMessage, 64> sidecar;
+      EXPECT(sidecar.open(name));
+
+      Queue<int, 64> wrongType;
+      EXPECT(!wrongType.open(name));
+
+      PlayMessage message = { SOUND_BLOOP, 3 };
+      EXPECT(game.tryPush(message));
+
+      PlayMessage received = { 0, 0 };
+      EXPECT(sidecar.tryPop(received));
+      EXPECT(received.id == SOUND_BLOOP && received.volume == 3);
+      EXPECT(!sidecar.tryPop(received));
+
+      // Nobody was waiting, so the producer didn't wake anyone.
+      EXPECT(game.numWakeUps() == 0);
+
+      // The sidecar sleeps when it runs dry and is woken by new messages.
+      static const int NUM_MESSAGES = 10000;
+      int numReceived = 0;
+      bool inOrder = true;
+      std::thread consumer([&]() {
+        while (numReceived < NUM_MESSAGES)
+        {
+          PlayMessage next;
+          if (!sidecar.waitPop(next, 100)) continue;
+          if (next.volume != numReceived) inOrder = false;
+          numReceived++;
+        }
+      });
+
+      for (int i = 0; i < NUM_MESSAGES; i++)
+      {
+        PlayMessage next = { SOUND_BLOOP, i };
+        while (!game.tryPush(next)) std::this_thread::yield();
+
+        // Pause now and then so the consumer has to go to sleep.
+        if (i % 1000 == 0)
+        {
+          std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+      }
+
+      consumer.join();
+      EXPECT(numReceived == NUM_MESSAGES);
+      EXPECT(inOrder);
+
+      Queue<PlayMessage, 64>::destroy(name);
+    }
+  }
+#endif
 }
 #endif
@@ -25,6 +25,29 @@ int main (int argc, char * const argv[])
 {
   UnbufferedSlapstick::testComedy();
   SpatialPartition::test();
+  HandlePool::test();
+  PagedPool::test();
+  ConcurrentPool::test();
+  SoAPool::test();
+  DensePool::test();
+#if defined(__cpp_lib_memory_resource)
+  PoolResource::test();
+#endif
+  EventQueue::SpscRing::test();
+  EventQueue::MpscQueue::test();
+  EventQueue::AudioThread::test();
+  EventQueue::Coalesced::test();
+  EventQueue::Prioritized::test();
+  EventQueue::EventBus::test();
+#if defined(__unix__) || defined(__APPLE__)
+  EventQueue::SoundCache::test();
+#endif
+  EventQueue::Channels::test();
+  EventQueue::Instrumented::test();
+#if defined(__unix__) || defined(__APPLE__)
+  EventQueue::Replay::test();
+  EventQueue::SharedMemory::test();
+#endif
   ObserverPattern::test();
 
   return 0;
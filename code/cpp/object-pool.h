@@ -1,4 +1,44 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <stdint.h>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+// std::pmr needs a C++17 library that actually ships it. Apple's libc++
+// only does for newer deployment targets, so go by the library's feature
+// macro instead of the language version.
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+
+#if defined(__cpp_lib_memory_resource)
+#include <memory_resource>
+#include <unordered_map>
+#endif
+
+#include "expect.h"
 
 namespace Version1
 {
@@ -319,6 +359,2094 @@ namespace Temp5
   };
 };
 
+namespace PoolTelemetry
+{
+  // Object lifetimes are counted in buckets that double in size. Bucket 0
+  // is objects that died in the frame they were created, bucket 1 is one
+  // frame, bucket 2 is two or three frames, bucket 3 is four to seven, and
+  // so on. The last bucket holds everything older.
+  static const int NUM_LIFETIME_BUCKETS = 16;
+
+  struct PoolStats
+  {
+    // How many frames the pool has been through.
+    int frame;
+
+    int numLive;
+
+    // The most objects that have been live at once. Size the pool to this.
+    int highWater;
+
+    // What happened since the last call to endFrame().
+    int createdThisFrame;
+    int destroyedThisFrame;
+    int failedThisFrame;
+
+    // Creates that failed because the pool was full, ever.
+    long totalFailed;
+
+    long lifetimes[NUM_LIFETIME_BUCKETS];
+  };
+
+  // Counts what happens in a pool. The pools call this on every create and
+  // destroy, and the game calls endFrame() on them once per frame.
+  class Tracker
+  {
+  public:
+    Tracker()
+    {
+      stats_.frame = 0;
+      stats_.numLive = 0;
+      stats_.highWater = 0;
+      stats_.createdThisFrame = 0;
+      stats_.destroyedThisFrame = 0;
+      stats_.failedThisFrame = 0;
+      stats_.totalFailed = 0;
+
+      for (int i = 0; i < NUM_LIFETIME_BUCKETS; i++)
+      {
+        stats_.lifetimes[i] = 0;
+      }
+    }
+
+    void recordCreate()
+    {
+      stats_.numLive++;
+      stats_.createdThisFrame++;
+      if (stats_.numLive > stats_.highWater)
+      {
+        stats_.highWater = stats_.numLive;
+      }
+    }
+
+    // [createdFrame] is the value of frame() when the object was created.
+    void recordDestroy(int createdFrame)
+    {
+      stats_.numLive--;
+      stats_.destroyedThisFrame++;
+      stats_.lifetimes[lifetimeBucket(stats_.frame - createdFrame)]++;
+    }
+
+    // [count] is how many objects couldn't be created.
+    void recordFailure(int count = 1)
+    {
+      stats_.failedThisFrame += count;
+      stats_.totalFailed += count;
+    }
+
+    void endFrame()
+    {
+      stats_.frame++;
+      stats_.createdThisFrame = 0;
+      stats_.destroyedThisFrame = 0;
+      stats_.failedThisFrame = 0;
+    }
+
+    int frame() const { return stats_.frame; }
+    const PoolStats& stats() const { return stats_; }
+
+    // Prints a line with this frame's numbers. If [showLifetimes] is true,
+    // it also prints the lifetime histogram.
+    void dump(const char* name, bool showLifetimes) const;
+
+    static int lifetimeBucket(int frames)
+    {
+      int bucket = 0;
+      while (frames > 0 && bucket < NUM_LIFETIME_BUCKETS - 1)
+      {
+        frames >>= 1;
+        bucket++;
+      }
+
+      return bucket;
+    }
+
+  private:
+    PoolStats stats_;
+  };
+
+  void Tracker::dump(const char* name, bool showLifetimes) const
+  {
+    printf("%s frame %d: %d live, %d high water, +%d -%d, %d failed\n",
+           name, stats_.frame, stats_.numLive, stats_.highWater,
+           stats_.createdThisFrame, stats_.destroyedThisFrame,
+           stats_.failedThisFrame);
+
+    if (!showLifetimes) return;
+
+    printf("  lifetimes:");
+    for (int i = 0; i < NUM_LIFETIME_BUCKETS; i++)
+    {
+      if (stats_.lifetimes[i] == 0) continue;
+
+      int low = i == 0 ? 0 : 1 << (i - 1);
+      printf(" %d+:%ld", low, stats_.lifetimes[i]);
+    }
+    printf("\n");
+  }
+}
+
+namespace PoolMemory
+{
+  enum PageSize
+  {
+    // Ordinary memory from the heap. The OS decides what pages back it.
+    DEFAULT_PAGES,
+
+    // Mapped directly and kept on ordinary 4KB pages, even where the OS
+    // would otherwise hand out transparent huge pages.
+    SMALL_PAGES,
+
+    // Memory mapped with 2MB pages, so that walking a big pool doesn't miss
+    // the TLB every 4KB. Falls back to small pages if the OS has none.
+    HUGE_PAGES
+  };
+
+  static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  // Memory for a pool's slots, and how the OS ended up backing it.
+  struct Block
+  {
+    void* memory;
+    size_t size;
+
+    // Whether it came from mmap() instead of the heap.
+    bool mapped;
+
+    // Mapped from the kernel's reserved huge pages.
+    bool hugeTlb;
+
+    // Asked the kernel to back it with transparent huge pages. It does this
+    // in the background, so it may still be partly small pages.
+    bool transparentHuge;
+
+    // Asked the kernel to never back it with huge pages.
+    bool smallOnly;
+
+    // Bound to the requested NUMA node.
+    bool numaBound;
+  };
+
+  // Allocates [size] bytes. If [numaNode] isn't -1, the memory is placed on
+  // that node where the OS supports it. All of the fancy options are best
+  // effort: if one isn't available, this quietly does without it.
+  Block allocate(size_t size, PageSize pageSize, int numaNode);
+  void free(const Block& block);
+
+#if defined(__unix__) || defined(__APPLE__)
+  // Maps [size] bytes starting at a multiple of [alignment].
+  void* mapAligned(size_t size, size_t alignment)
+  {
+    size_t padded = size + alignment;
+    void* memory = mmap(NULL, padded, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    // Trim off the unaligned head and whatever is left past the end.
+    uintptr_t start = (uintptr_t)memory;
+    uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned > start) munmap(memory, aligned - start);
+
+    uintptr_t end = aligned + size;
+    uintptr_t paddedEnd = start + padded;
+    if (paddedEnd > end) munmap((void*)end, paddedEnd - end);
+
+    return (void*)aligned;
+  }
+#endif
+
+  Block allocate(size_t size, PageSize pageSize, int numaNode)
+  {
+    Block block = { NULL, size, false, false, false, false, false };
+
+#if defined(__unix__) || defined(__APPLE__)
+    if (pageSize != DEFAULT_PAGES || numaNode != -1)
+    {
+      if (pageSize == HUGE_PAGES)
+      {
+        // Huge page mappings have to be a whole number of huge pages.
+        block.size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+      }
+      else
+      {
+        size_t pageBytes = (size_t)sysconf(_SC_PAGESIZE);
+        block.size = (size + pageBytes - 1) & ~(pageBytes - 1);
+      }
+
+#if defined(MAP_HUGETLB)
+      if (pageSize == HUGE_PAGES)
+      {
+        block.memory = mmap(NULL, block.size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+        if (block.memory == MAP_FAILED)
+        {
+          block.memory = NULL;
+        }
+        else
+        {
+          block.hugeTlb = true;
+        }
+      }
+#endif
+
+      if (block.memory == NULL)
+      {
+        // Transparent huge pages only cover aligned 2MB ranges.
+        block.memory = mapAligned(block.size, pageSize == HUGE_PAGES ?
+                                  HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE));
+      }
+
+      if (block.memory != NULL)
+      {
+        block.mapped = true;
+
+#if defined(MADV_HUGEPAGE)
+        if (pageSize == HUGE_PAGES && !block.hugeTlb)
+        {
+          block.transparentHuge =
+              madvise(block.memory, block.size, MADV_HUGEPAGE) == 0;
+        }
+#endif
+
+#if defined(MADV_NOHUGEPAGE)
+        if (pageSize == SMALL_PAGES)
+        {
+          block.smallOnly =
+              madvise(block.memory, block.size, MADV_NOHUGEPAGE) == 0;
+        }
+#endif
+
+#if defined(__linux__) && defined(SYS_mbind)
+        // Calls mbind() directly so that we don't need libnuma. This has to
+        // happen before anything touches the pages.
+        if (numaNode >= 0 && numaNode < 64)
+        {
+          // MPOL_BIND from <numaif.h>.
+          static const int BIND_POLICY = 2;
+          unsigned long nodeMask = 1UL << numaNode;
+
+          // The kernel only reads maxnode - 1 bits of the mask.
+          block.numaBound = syscall(SYS_mbind, block.memory, block.size,
+                                    BIND_POLICY, &nodeMask,
+                                    sizeof(nodeMask) * 8 + 1, 0) == 0;
+        }
+#endif
+
+        return block;
+      }
+    }
+#endif
+
+    block.size = size;
+    block.memory = ::operator new(size);
+    return block;
+  }
+
+  void free(const Block& block)
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    if (block.mapped)
+    {
+      munmap(block.memory, block.size);
+      return;
+    }
+#endif
+
+    ::operator delete(block.memory);
+  }
+}
+
+namespace HandlePool
+{
+  // Identifies an object in a Pool. The low INDEX_BITS are the object's slot
+  // and the rest are the slot's generation, which changes every time the
+  // slot is freed. Using a handle after its object is destroyed is detected
+  // instead of silently touching whatever reused the slot.
+  typedef uint32_t Handle;
+
+  static const Handle NO_HANDLE = 0;
+  static const int INDEX_BITS = 20;
+  static const uint32_t INDEX_MASK = (1 << INDEX_BITS) - 1;
+  static const uint32_t GENERATION_MASK = (1 << (32 - INDEX_BITS)) - 1;
+  static const int MAX_CAPACITY = 1 << INDEX_BITS;
+
+  // A fixed-size pool of TObjects. All of the memory is allocated up front
+  // and objects are constructed in place, so creating and destroying them
+  // never touches the heap. Which slots are live is tracked in a bitmap,
+  // one bit per slot, so walking a mostly empty pool can skip over 64 empty
+  // slots at a time.
+  //
+  // Big pools can ask for their slots to be backed by huge pages and placed
+  // on a specific NUMA node. See PoolMemory.
+  template <class TObject>
+  class Pool
+  {
+  public:
+    Pool(int capacity,
+         PoolMemory::PageSize pageSize = PoolMemory::DEFAULT_PAGES,
+         int numaNode = -1)
+    : capacity_(capacity)
+    {
+      assert(capacity > 0 && capacity <= MAX_CAPACITY);
+
+      // Slots are plain data, so they don't need constructing.
+      memory_ = PoolMemory::allocate(sizeof(Slot) * capacity_, pageSize,
+                                     numaNode);
+      slots_ = static_cast<Slot*>(memory_.memory);
+
+      numWords_ = (capacity_ + 63) / 64;
+      occupied_ = new uint64_t[numWords_];
+      for (int i = 0; i < numWords_; i++) occupied_[i] = 0;
+
+      // Each slot points to the next.
+      for (int i = 0; i < capacity_; i++)
+      {
+        // Generations start at one so that no handle is ever NO_HANDLE.
+        slots_[i].generation = 1;
+        slots_[i].next = i + 1;
+      }
+
+      // The last one terminates the list.
+      slots_[capacity_ - 1].next = -1;
+      firstAvailable_ = 0;
+    }
+
+    ~Pool()
+    {
+      forEachLive(destroyObject);
+
+      PoolMemory::free(memory_);
+      delete [] occupied_;
+    }
+
+    // Constructs a new object from [args]. Returns NO_HANDLE if the pool is
+    // full.
+    template <typename... Args>
+    Handle create(Args&&... args)
+    {
+      if (firstAvailable_ == -1)
+      {
+        tracker_.recordFailure();
+        return NO_HANDLE;
+      }
+
+      // Remove it from the available list.
+      int index = firstAvailable_;
+      Slot& slot = slots_[index];
+      firstAvailable_ = slot.next;
+
+      new (&slot.storage) TObject(std::forward<Args>(args)...);
+      occupied_[index / 64] |= (uint64_t)1 << (index % 64);
+      slot.createdFrame = tracker_.frame();
+      tracker_.recordCreate();
+
+      return (slot.generation << INDEX_BITS) | (uint32_t)index;
+    }
+
+    // Destroys the object [handle] refers to. Does nothing if it's stale.
+    void destroy(Handle handle)
+    {
+      int index = indexOf(handle);
+      if (index == -1) return;
+
+      Slot& slot = slots_[index];
+      object(index)->~TObject();
+      occupied_[index / 64] &= ~((uint64_t)1 << (index % 64));
+
+      // Invalidate every outstanding handle to this slot.
+      slot.generation = (slot.generation + 1) & GENERATION_MASK;
+      if (slot.generation == 0) slot.generation = 1;
+
+      // Add it to the front of the list.
+      slot.next = firstAvailable_;
+      firstAvailable_ = index;
+      tracker_.recordDestroy(slot.createdFrame);
+    }
+
+    // Returns the object [handle] refers to, or NULL if it's been destroyed.
+    TObject* get(Handle handle)
+    {
+      int index = indexOf(handle);
+      if (index == -1) return NULL;
+      return object(index);
+    }
+
+    bool isValid(Handle handle) const { return indexOf(handle) != -1; }
+
+    // Returns the handle for [object], or NO_HANDLE if it isn't a live
+    // object in this pool.
+    Handle handleOf(const TObject* object) const
+    {
+      // The object is the first thing in its slot.
+      uintptr_t address = (uintptr_t)object;
+      uintptr_t start = (uintptr_t)slots_;
+      if (address < start) return NO_HANDLE;
+
+      size_t offset = address - start;
+      int index = (int)(offset / sizeof(Slot));
+      if (offset % sizeof(Slot) != 0 || index >= capacity_) return NO_HANDLE;
+      if (!isLive(index)) return NO_HANDLE;
+
+      return (slots_[index].generation << INDEX_BITS) | (uint32_t)index;
+    }
+
+    // Calls [callback] with each live object, in slot order.
+    template <class Callback>
+    void forEachLive(Callback callback)
+    {
+      for (int i = 0; i < numWords_; i++)
+      {
+        uint64_t word = occupied_[i];
+
+        // Visit each set bit, lowest first, clearing it as we go. An empty
+        // word is skipped in one comparison.
+        while (word != 0)
+        {
+          int bit = __builtin_ctzll(word);
+          callback(*object(i * 64 + bit));
+          word &= word - 1;
+        }
+      }
+    }
+
+    int capacity() const { return capacity_; }
+    int numLive() const { return tracker_.stats().numLive; }
+
+    // Call once per frame to reset the per-frame counters.
+    void endFrame() { tracker_.endFrame(); }
+    const PoolTelemetry::PoolStats& stats() const { return tracker_.stats(); }
+    const PoolTelemetry::Tracker& tracker() const { return tracker_; }
+
+    // Where the slots live.
+    const PoolMemory::Block& memory() const { return memory_; }
+
+  private:
+    struct Slot
+    {
+      typename std::aligned_storage<sizeof(TObject),
+                                    std::alignment_of<TObject>::value>::type
+          storage;
+
+      uint32_t generation;
+
+      // The next available slot when this one isn't live.
+      int next;
+
+      // The frame the live object was created in.
+      int createdFrame;
+    };
+
+    static void destroyObject(TObject& object)
+    {
+      object.~TObject();
+    }
+
+    bool isLive(int index) const
+    {
+      return (occupied_[index / 64] >> (index % 64)) & 1;
+    }
+
+    TObject* object(int index)
+    {
+      return reinterpret_cast<TObject*>(&slots_[index].storage);
+    }
+
+    int indexOf(Handle handle) const
+    {
+      int index = (int)(handle & INDEX_MASK);
+      if (index >= capacity_) return -1;
+
+      if (!isLive(index)) return -1;
+      if (slots_[index].generation != handle >> INDEX_BITS) return -1;
+
+      return index;
+    }
+
+    Pool(const Pool&);
+    Pool& operator=(const Pool&);
+
+    PoolMemory::Block memory_;
+    Slot* slots_;
+    int capacity_;
+    int firstAvailable_;
+
+    PoolTelemetry::Tracker tracker_;
+
+    // Bit i % 64 of word i / 64 is set if slot i is live.
+    uint64_t* occupied_;
+    int numWords_;
+  };
+
+  class Particle
+  {
+  public:
+    Particle(double x, double y, double xVel, double yVel, int lifetime)
+    : framesLeft_(lifetime),
+      x_(x), y_(y),
+      xVel_(xVel), yVel_(yVel)
+    {
+      numParticles++;
+    }
+
+    ~Particle()
+    {
+      numParticles--;
+    }
+
+    double x() const { return x_; }
+
+    static int numParticles;
+
+  private:
+    int framesLeft_;
+    double x_, y_;
+    double xVel_, yVel_;
+  };
+
+  int Particle::numParticles = 0;
+
+  double sumX = 0;
+
+  void addX(Particle& particle)
+  {
+    sumX += particle.x();
+  }
+
+  void test()
+  {
+    std::cout << "Testing handle pool" << std::endl;
+
+    {
+      Pool<Particle> pool(2);
+
+      Handle a = pool.create(1, 2, 3, 4, 10);
+      Handle b = pool.create(5, 6, 7, 8, 10);
+      EXPECT(Particle::numParticles == 2);
+      EXPECT(pool.get(a)->x() == 1);
+      EXPECT(pool.get(b)->x() == 5);
+
+      // It's full.
+      EXPECT(pool.create(0, 0, 0, 0, 10) == NO_HANDLE);
+
+      // Stale handles are caught, even once the slot is reused.
+      pool.destroy(a);
+      EXPECT(Particle::numParticles == 1);
+      EXPECT(pool.get(a) == NULL);
+
+      Handle c = pool.create(9, 9, 9, 9, 10);
+      EXPECT(c != a);
+      EXPECT(pool.get(a) == NULL);
+      EXPECT(pool.get(c)->x() == 9);
+
+      // Destroying twice is harmless.
+      pool.destroy(a);
+      EXPECT(pool.numLive() == 2);
+    }
+
+    // The pool destroys whatever is still live.
+    EXPECT(Particle::numParticles == 0);
+
+    // Only live objects are visited, across word boundaries.
+    {
+      Pool<Particle> pool(200);
+      Handle handles[200];
+      for (int i = 0; i < 200; i++) handles[i] = pool.create(i, 0, 0, 0, 1);
+      for (int i = 0; i < 200; i++)
+      {
+        if (i != 3 && i != 64 && i != 199) pool.destroy(handles[i]);
+      }
+
+      sumX = 0;
+      pool.forEachLive(addX);
+      EXPECT(sumX == 3 + 64 + 199);
+    }
+
+    EXPECT(Particle::numParticles == 0);
+
+    // Telemetry.
+    {
+      Pool<Particle> pool(3);
+      Handle a = pool.create(0, 0, 0, 0, 1);
+      Handle b = pool.create(0, 0, 0, 0, 1);
+      pool.destroy(a);
+      EXPECT(pool.stats().createdThisFrame == 2);
+      EXPECT(pool.stats().destroyedThisFrame == 1);
+      EXPECT(pool.stats().lifetimes[0] == 1);
+
+      pool.endFrame();
+      pool.endFrame();
+      pool.endFrame();
+      pool.create(0, 0, 0, 0, 1);
+      pool.create(0, 0, 0, 0, 1);
+      EXPECT(pool.create(0, 0, 0, 0, 1) == NO_HANDLE);
+      pool.destroy(b);
+
+      const PoolTelemetry::PoolStats& stats = pool.stats();
+      EXPECT(stats.frame == 3);
+      EXPECT(stats.numLive == 2);
+      EXPECT(stats.highWater == 3);
+      EXPECT(stats.createdThisFrame == 2);
+      EXPECT(stats.failedThisFrame == 1);
+
+      // Lived for three frames.
+      EXPECT(stats.lifetimes[2] == 1);
+    }
+
+    // Huge pages behave like any other memory, whether or not the OS
+    // actually hands them out.
+    {
+      Pool<Particle> pool(100000, PoolMemory::HUGE_PAGES, 0);
+      Handle first = pool.create(1, 0, 0, 0, 1);
+      Handle last = NO_HANDLE;
+      while (pool.numLive() < pool.capacity())
+      {
+        last = pool.create(2, 0, 0, 0, 1);
+      }
+
+      EXPECT(pool.get(first)->x() == 1);
+      EXPECT(pool.get(last)->x() == 2);
+      EXPECT(pool.memory().size >= sizeof(Particle) * 100000);
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    // Small pages are mapped separately from the heap so they can be kept
+    // off huge pages.
+    {
+      Pool<Particle> pool(1000, PoolMemory::SMALL_PAGES);
+      EXPECT(pool.memory().mapped);
+      EXPECT(!pool.memory().hugeTlb && !pool.memory().transparentHuge);
+    }
+#endif
+
+    EXPECT(Particle::numParticles == 0);
+  }
+}
+
+namespace PagedPool
+{
+  class Particle
+  {
+  public:
+    Particle()
+    : framesLeft_(0)
+    {}
+
+    void init(double x, double y,
+              double xVel, double yVel, int lifetime)
+    {
+      state_.live.x = x; state_.live.y = y;
+      state_.live.xVel = xVel; state_.live.yVel = yVel;
+      framesLeft_ = lifetime;
+    }
+
+    // Returns true if the particle died this frame.
+    bool animate()
+    {
+      if (!inUse()) return false;
+
+      framesLeft_--;
+      state_.live.x += state_.live.xVel;
+      state_.live.y += state_.live.yVel;
+
+      return framesLeft_ == 0;
+    }
+
+    bool inUse() const { return framesLeft_ > 0; }
+
+    double x() const { return state_.live.x; }
+    double y() const { return state_.live.y; }
+
+    Particle* getNext() const { return state_.next; }
+    void setNext(Particle* next) { state_.next = next; }
+
+  private:
+    int framesLeft_;
+
+    union
+    {
+      // State when it's in use.
+      struct
+      {
+        double x, y;
+        double xVel, yVel;
+      } live;
+
+      // State when it's available.
+      Particle* next;
+    } state_;
+  };
+
+  // A particle pool that grows instead of running out. Particles live in
+  // fixed-size pages that are allocated as needed and never move, so a
+  // pointer to a particle stays valid until it dies. When particles die
+  // off, pages that end up empty are unmapped and go back to the OS, except
+  // for a few that are kept around so that a pool hovering near a page
+  // boundary doesn't allocate and free a page every frame.
+  class ParticlePool
+  {
+  public:
+    static const int PAGE_SIZE = 4096;
+
+    ParticlePool(int maxEmptyPages)
+    : maxEmptyPages_(maxEmptyPages),
+      numLive_(0)
+    {}
+
+    ~ParticlePool()
+    {
+      for (size_t i = 0; i < pages_.size(); i++) freePage(pages_[i]);
+    }
+
+    // Returns NULL if [lifetime] isn't positive.
+    Particle* create(double x, double y,
+                     double xVel, double yVel, int lifetime);
+
+    void animate();
+
+    int numLive() const { return numLive_; }
+    int numPages() const { return (int)pages_.size(); }
+
+  private:
+    struct Page
+    {
+      Page();
+
+      Particle particles[PAGE_SIZE];
+      Particle* firstAvailable;
+      int numLive;
+
+      // Whether this page is in the pool's available_ list.
+      bool isListed;
+
+      PoolMemory::Block memory;
+    };
+
+    // Pages are mapped straight from the OS instead of coming from the heap.
+    // Otherwise, freeing one would only hand it back to malloc, which keeps
+    // it.
+    static Page* allocatePage();
+    static void freePage(Page* page);
+
+    void releaseEmptyPages();
+
+    ParticlePool(const ParticlePool&);
+    ParticlePool& operator=(const ParticlePool&);
+
+    std::vector<Page*> pages_;
+
+    // Pages that may have a free particle. Full pages are dropped from this
+    // lazily when create() comes across them.
+    std::vector<Page*> available_;
+
+    int maxEmptyPages_;
+    int numLive_;
+  };
+
+  ParticlePool::Page::Page()
+  : numLive(0),
+    isListed(false)
+  {
+    // Each particle points to the next.
+    firstAvailable = &particles[0];
+    for (int i = 0; i < PAGE_SIZE - 1; i++)
+    {
+      particles[i].setNext(&particles[i + 1]);
+    }
+
+    // The last one terminates the list.
+    particles[PAGE_SIZE - 1].setNext(NULL);
+  }
+
+  ParticlePool::Page* ParticlePool::allocatePage()
+  {
+    PoolMemory::Block memory =
+        PoolMemory::allocate(sizeof(Page), PoolMemory::SMALL_PAGES, -1);
+    Page* page = new (memory.memory) Page();
+    page->memory = memory;
+    return page;
+  }
+
+  void ParticlePool::freePage(Page* page)
+  {
+    PoolMemory::Block memory = page->memory;
+    page->~Page();
+    PoolMemory::free(memory);
+  }
+
+  Particle* ParticlePool::create(double x, double y,
+                                 double xVel, double yVel,
+                                 int lifetime)
+  {
+    // It would never count down to zero, so its slot would never come back.
+    if (lifetime <= 0) return NULL;
+
+    // Skip past any pages that have filled up.
+    while (!available_.empty() && available_.back()->firstAvailable == NULL)
+    {
+      available_.back()->isListed = false;
+      available_.pop_back();
+    }
+
+    if (available_.empty())
+    {
+      Page* page = allocatePage();
+      page->isListed = true;
+      pages_.push_back(page);
+      available_.push_back(page);
+    }
+
+    // Remove it from the available list.
+    Page* page = available_.back();
+    Particle* newParticle = page->firstAvailable;
+    page->firstAvailable = newParticle->getNext();
+    page->numLive++;
+    numLive_++;
+
+    newParticle->init(x, y, xVel, yVel, lifetime);
+    return newParticle;
+  }
+
+  void ParticlePool::animate()
+  {
+    for (size_t i = 0; i < pages_.size(); i++)
+    {
+      Page* page = pages_[i];
+      if (page->numLive == 0) continue;
+
+      for (int j = 0; j < PAGE_SIZE; j++)
+      {
+        if (!page->particles[j].animate()) continue;
+
+        // Add this particle to the front of its page's list.
+        page->particles[j].setNext(page->firstAvailable);
+        page->firstAvailable = &page->particles[j];
+        page->numLive--;
+        numLive_--;
+
+        if (!page->isListed)
+        {
+          page->isListed = true;
+          available_.push_back(page);
+        }
+      }
+    }
+
+    releaseEmptyPages();
+  }
+
+  void ParticlePool::releaseEmptyPages()
+  {
+    int numEmpty = 0;
+    for (size_t i = 0; i < pages_.size(); i++)
+    {
+      if (pages_[i]->numLive == 0) numEmpty++;
+    }
+
+    if (numEmpty <= maxEmptyPages_) return;
+
+    // Free the surplus empty pages and rebuild the available list without
+    // them.
+    int numToFree = numEmpty - maxEmptyPages_;
+    available_.clear();
+    for (size_t i = 0; i < pages_.size(); )
+    {
+      Page* page = pages_[i];
+      if (page->numLive == 0 && numToFree > 0)
+      {
+        freePage(page);
+        pages_[i] = pages_.back();
+        pages_.pop_back();
+        numToFree--;
+        continue;
+      }
+
+      page->isListed = page->firstAvailable != NULL;
+      if (page->isListed) available_.push_back(page);
+      i++;
+    }
+  }
+
+  void test()
+  {
+    std::cout << "Testing paged pool" << std::endl;
+
+    ParticlePool pool(1);
+
+    // Fill more than a few pages.
+    Particle* first = pool.create(1, 2, 0, 0, 10);
+    for (int i = 1; i < ParticlePool::PAGE_SIZE * 3; i++)
+    {
+      pool.create(i, i, 1, 1, i < ParticlePool::PAGE_SIZE ? 10 : 2);
+    }
+
+    EXPECT(pool.numPages() == 3);
+    EXPECT(pool.numLive() == ParticlePool::PAGE_SIZE * 3);
+
+    // Growing didn't move the existing particles.
+    EXPECT(first->x() == 1);
+    EXPECT(first->y() == 2);
+
+    // Once the short-lived ones die, only one empty page is kept.
+    pool.animate();
+    pool.animate();
+    EXPECT(pool.numLive() == ParticlePool::PAGE_SIZE);
+    EXPECT(pool.numPages() == 2);
+    EXPECT(first->inUse());
+    EXPECT(first->x() == 1);
+
+    // New particles go into the existing free space.
+    pool.create(0, 0, 0, 0, 10);
+    EXPECT(pool.numPages() == 2);
+
+    // A particle that's already dead doesn't take a slot.
+    EXPECT(pool.create(0, 0, 0, 0, 0) == NULL);
+    EXPECT(pool.numLive() == ParticlePool::PAGE_SIZE + 1);
+  }
+}
+
+namespace ConcurrentPool
+{
+  // A fixed-size pool that many threads can create and destroy objects in
+  // at once. Free slots live on a lock-free global stack, but threads rarely
+  // touch it: each one goes through its own Cache, which holds a handful of
+  // free slots and only goes to the global stack to refill or drain half of
+  // itself at a time.
+  //
+  // Slots sitting in one thread's cache can't be used by another thread, so
+  // a pool can look full while up to CACHE_SIZE slots per cache are free.
+  // Size the pool for the most objects live at once plus that many per
+  // thread, or have idle threads call Cache::flush().
+  template <class TObject>
+  class Pool
+  {
+  public:
+    class Cache;
+
+    static const int CACHE_SIZE = 32;
+
+    Pool(int capacity)
+    : capacity_(capacity)
+    {
+      slots_ = new Slot[capacity_];
+
+      // Each slot points to the next.
+      for (int i = 0; i < capacity_ - 1; i++)
+      {
+        slots_[i].next.store(i + 1, std::memory_order_relaxed);
+      }
+
+      // The last one terminates the list.
+      slots_[capacity_ - 1].next.store(EMPTY, std::memory_order_relaxed);
+      head_.store(0);
+    }
+
+    // Every Cache must be destroyed before the pool, and every object
+    // created from it destroyed before that.
+    ~Pool()
+    {
+      delete [] slots_;
+    }
+
+    int capacity() const { return capacity_; }
+
+  private:
+    static const int EMPTY = -1;
+
+    struct Slot
+    {
+      typename std::aligned_storage<sizeof(TObject),
+                                    std::alignment_of<TObject>::value>::type
+          storage;
+
+      // The next free slot while this one is on the global stack. Other
+      // threads may read it after the slot has been popped, so it is kept
+      // separate from the object's storage.
+      std::atomic<int> next;
+    };
+
+    // Pops a free slot off the global stack, or returns EMPTY.
+    int pop();
+
+    // Pushes the slots from [first] to [last], already linked together
+    // through their next fields, onto the global stack in one step.
+    void push(int first, int last);
+
+    Pool(const Pool&);
+    Pool& operator=(const Pool&);
+
+    Slot* slots_;
+    int capacity_;
+
+    // The index of the top free slot in the low 32 bits and a tag that
+    // changes on every update in the high bits. Without the tag, a thread
+    // could see the same top slot before and after other threads popped it
+    // and pushed it back, and swap in a next pointer that's no longer right.
+    alignas(64) std::atomic<uint64_t> head_;
+    char padding_[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  // Each thread creates its own Cache for the pool and uses it for all of
+  // its creates and destroys. An object may be destroyed through a different
+  // thread's cache than the one that created it.
+  template <class TObject>
+  class alignas(64) Pool<TObject>::Cache
+  {
+  public:
+    Cache(Pool<TObject>& pool)
+    : pool_(pool),
+      count_(0)
+    {}
+
+    ~Cache()
+    {
+      flush(count_);
+    }
+
+    // Constructs a new object from [args]. Returns NULL if this cache and
+    // the global stack are both empty, even if other caches still hold free
+    // slots.
+    template <typename... Args>
+    TObject* create(Args&&... args)
+    {
+      if (count_ == 0)
+      {
+        // Refill half of the cache from the global stack.
+        while (count_ < CACHE_SIZE / 2)
+        {
+          int index = pool_.pop();
+          if (index == EMPTY) break;
+          indexes_[count_++] = index;
+        }
+
+        if (count_ == 0) return NULL;
+      }
+
+      Slot& slot = pool_.slots_[indexes_[--count_]];
+      return new (&slot.storage) TObject(std::forward<Args>(args)...);
+    }
+
+    void destroy(TObject* object)
+    {
+      object->~TObject();
+
+      if (count_ == CACHE_SIZE) flush(CACHE_SIZE / 2);
+
+      // The object is the first thing in its slot.
+      Slot* slot = reinterpret_cast<Slot*>(object);
+      indexes_[count_++] = (int)(slot - pool_.slots_);
+    }
+
+    // Gives every cached slot back to the global stack so other threads can
+    // use them. Call this when the thread is going idle.
+    void flush()
+    {
+      flush(count_);
+    }
+
+    int numCached() const { return count_; }
+
+  private:
+    // Gives the oldest [numSlots] cached slots back to the global stack.
+    void flush(int numSlots)
+    {
+      if (numSlots == 0) return;
+
+      for (int i = 0; i < numSlots - 1; i++)
+      {
+        pool_.slots_[indexes_[i]].next.store(indexes_[i + 1],
+                                             std::memory_order_relaxed);
+      }
+      pool_.push(indexes_[0], indexes_[numSlots - 1]);
+
+      // Shift the rest down.
+      for (int i = numSlots; i < count_; i++)
+      {
+        indexes_[i - numSlots] = indexes_[i];
+      }
+      count_ -= numSlots;
+    }
+
+    Cache(const Cache&);
+    Cache& operator=(const Cache&);
+
+    Pool<TObject>& pool_;
+    int indexes_[CACHE_SIZE];
+    int count_;
+  };
+
+  template <class TObject>
+  int Pool<TObject>::pop()
+  {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    while (true)
+    {
+      int index = (int)(uint32_t)head;
+      if (index == EMPTY) return EMPTY;
+
+      // If another thread pops this slot first, this may read a stale next,
+      // but then the tag will have changed and the exchange will fail.
+      int next = slots_[index].next.load(std::memory_order_relaxed);
+      uint64_t tag = (head >> 32) + 1;
+      uint64_t newHead = (tag << 32) | (uint32_t)next;
+
+      if (head_.compare_exchange_weak(head, newHead,
+                                      std::memory_order_acquire,
+                                      std::memory_order_acquire))
+      {
+        return index;
+      }
+    }
+  }
+
+  template <class TObject>
+  void Pool<TObject>::push(int first, int last)
+  {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    while (true)
+    {
+      slots_[last].next.store((int)(uint32_t)head,
+                              std::memory_order_relaxed);
+      uint64_t tag = (head >> 32) + 1;
+      uint64_t newHead = (tag << 32) | (uint32_t)first;
+
+      if (head_.compare_exchange_weak(head, newHead,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed))
+      {
+        return;
+      }
+    }
+  }
+
+  struct Projectile
+  {
+    Projectile(int owner, int frame)
+    : owner(owner),
+      frame(frame)
+    {}
+
+    int owner;
+    int frame;
+  };
+
+  void test()
+  {
+    std::cout << "Testing concurrent pool" << std::endl;
+
+    static const int NUM_THREADS = 4;
+    static const int CAPACITY = 1000;
+    Pool<Projectile> pool(CAPACITY);
+
+    // Each thread churns through objects, and hands some of them to the
+    // next thread to destroy.
+    std::atomic<int> numBad(0);
+    Projectile* handoff[NUM_THREADS][100];
+    std::thread threads[NUM_THREADS];
+    for (int t = 0; t < NUM_THREADS; t++)
+    {
+      threads[t] = std::thread([&, t]() {
+        Pool<Projectile>::Cache cache(pool);
+        Projectile* live[100];
+        for (int frame = 0; frame < 1000; frame++)
+        {
+          for (int i = 0; i < 100; i++)
+          {
+            live[i] = cache.create(t, frame);
+            if (live[i] == NULL) numBad++;
+          }
+
+          for (int i = 0; i < 100; i++)
+          {
+            if (live[i] == NULL) continue;
+            if (live[i]->owner != t || live[i]->frame != frame) numBad++;
+            cache.destroy(live[i]);
+          }
+        }
+
+        for (int i = 0; i < 100; i++) handoff[t][i] = cache.create(t, 0);
+      });
+    }
+
+    for (int t = 0; t < NUM_THREADS; t++) threads[t].join();
+    EXPECT(numBad.load() == 0);
+
+    {
+      Pool<Projectile>::Cache cache(pool);
+      for (int t = 0; t < NUM_THREADS; t++)
+      {
+        for (int i = 0; i < 100; i++) cache.destroy(handoff[t][i]);
+      }
+    }
+
+    // Every slot made it back to the pool.
+    Pool<Projectile>::Cache cache(pool);
+    std::vector<Projectile*> all;
+    for (int i = 0; i < CAPACITY; i++) all.push_back(cache.create(0, 0));
+    EXPECT(std::find(all.begin(), all.end(),
+                     (Projectile*)NULL) == all.end());
+    EXPECT(cache.create(0, 0) == NULL);
+    for (int i = 0; i < CAPACITY; i++) cache.destroy(all[i]);
+    cache.flush();
+    EXPECT(cache.numCached() == 0);
+
+    // One cache can run dry while another is holding free slots, until that
+    // one flushes them.
+    Pool<Projectile> small(64);
+    Pool<Projectile>::Cache holder(small);
+    Pool<Projectile>::Cache taker(small);
+
+    Projectile* objects[64];
+    for (int i = 0; i < 64; i++) objects[i] = holder.create(0, 0);
+    for (int i = 0; i < 64; i++) holder.destroy(objects[i]);
+    EXPECT(holder.numCached() > 0);
+
+    int numTaken = 0;
+    while (numTaken < 64 && (objects[numTaken] = taker.create(1, 0)) != NULL)
+    {
+      numTaken++;
+    }
+    EXPECT(numTaken == 64 - holder.numCached());
+
+    holder.flush();
+    while (numTaken < 64 && (objects[numTaken] = taker.create(1, 0)) != NULL)
+    {
+      numTaken++;
+    }
+    EXPECT(numTaken == 64);
+    for (int i = 0; i < 64; i++) taker.destroy(objects[i]);
+  }
+}
+
+namespace SoAPool
+{
+  // Adds [velocity] to [position] for [count] elements. This is the hot loop
+  // of animate(), so it uses the widest vector instructions the compiler is
+  // allowed to: four doubles at a time with AVX, two with SSE2.
+  void integrate(double* position, const double* velocity, int count)
+  {
+    int i = 0;
+
+#if defined(__AVX__)
+    for (; i + 4 <= count; i += 4)
+    {
+      __m256d sum = _mm256_add_pd(_mm256_loadu_pd(position + i),
+                                  _mm256_loadu_pd(velocity + i));
+      _mm256_storeu_pd(position + i, sum);
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= count; i += 2)
+    {
+      __m128d sum = _mm_add_pd(_mm_loadu_pd(position + i),
+                               _mm_loadu_pd(velocity + i));
+      _mm_storeu_pd(position + i, sum);
+    }
+#endif
+
+    // Whatever is left over.
+    for (; i < count; i++) position[i] += velocity[i];
+  }
+
+  // The same particles as Version1, but each field is stored in its own
+  // array instead of storing each particle's fields together. Moving the
+  // particles only streams through the position and velocity arrays, and
+  // they're laid out just right for SIMD.
+  class ParticlePool
+  {
+  public:
+    ParticlePool(int capacity)
+    : x_(capacity, 0), y_(capacity, 0),
+      xVel_(capacity, 0), yVel_(capacity, 0),
+      framesLeft_(capacity, 0)
+    {
+      // Hand out the low slots first.
+      for (int i = capacity - 1; i >= 0; i--) available_.push_back(i);
+    }
+
+    // Returns false if the pool is full or [lifetime] isn't positive.
+    bool create(double x, double y,
+                double xVel, double yVel, int lifetime);
+
+    void animate();
+
+    int numLive() const { return capacity() - (int)available_.size(); }
+    int capacity() const { return (int)framesLeft_.size(); }
+
+    bool inUse(int index) const { return framesLeft_[index] > 0; }
+    double x(int index) const { return x_[index]; }
+    double y(int index) const { return y_[index]; }
+
+  private:
+    std::vector<double> x_, y_;
+    std::vector<double> xVel_, yVel_;
+    std::vector<int> framesLeft_;
+
+    // Indexes of the slots that aren't in use.
+    std::vector<int> available_;
+  };
+
+  bool ParticlePool::create(double x, double y,
+                            double xVel, double yVel,
+                            int lifetime)
+  {
+    // A particle that never counts down to zero would never be recycled.
+    if (lifetime <= 0 || available_.empty()) return false;
+
+    int index = available_.back();
+    available_.pop_back();
+
+    x_[index] = x; y_[index] = y;
+    xVel_[index] = xVel; yVel_[index] = yVel;
+    framesLeft_[index] = lifetime;
+    return true;
+  }
+
+  void ParticlePool::animate()
+  {
+    // Move every particle without checking if it's in use. Dead particles
+    // have zero velocity, so this leaves them where they are, and skipping
+    // the check keeps the loop branch free.
+    integrate(x_.data(), xVel_.data(), capacity());
+    integrate(y_.data(), yVel_.data(), capacity());
+
+    for (int i = 0; i < capacity(); i++)
+    {
+      if (framesLeft_[i] == 0) continue;
+      if (--framesLeft_[i] > 0) continue;
+
+      // It died, so stop it and make it available again.
+      xVel_[i] = 0;
+      yVel_[i] = 0;
+      available_.push_back(i);
+    }
+  }
+
+  void test()
+  {
+    std::cout << "Testing SoA pool" << std::endl;
+
+    ParticlePool pool(7);
+    EXPECT(pool.create(0, 0, 1, 2, 2));
+    EXPECT(pool.create(10, 10, -1, 0, 3));
+    EXPECT(pool.numLive() == 2);
+
+    pool.animate();
+    EXPECT(pool.x(0) == 1 && pool.y(0) == 2);
+    EXPECT(pool.x(1) == 9 && pool.y(1) == 10);
+
+    // The first one dies and stays put.
+    pool.animate();
+    pool.animate();
+    EXPECT(!pool.inUse(0));
+    EXPECT(pool.x(0) == 2 && pool.y(0) == 4);
+    EXPECT(pool.x(1) == 7);
+    EXPECT(pool.numLive() == 0);
+
+    // A particle that's already dead doesn't take a slot.
+    EXPECT(!pool.create(0, 0, 1, 0, 0));
+    EXPECT(!pool.create(0, 0, 1, 0, -1));
+    EXPECT(pool.numLive() == 0);
+
+    // Fill it up, including the slots past the last full vector.
+    for (int i = 0; i < 7; i++) EXPECT(pool.create(i, 0, 1, 0, 5));
+    EXPECT(!pool.create(0, 0, 0, 0, 5));
+
+    pool.animate();
+    EXPECT(pool.x(6) == 6 + 1);
+  }
+}
+
+namespace JobSystem
+{
+  // A fixed set of threads for splitting one job across cores. The thread
+  // that calls run() does a share of the work too.
+  class Workers
+  {
+  public:
+    // Starts [numWorkers] - 1 threads.
+    Workers(int numWorkers)
+    : job_(NULL),
+      generation_(0),
+      numPending_(0),
+      quit_(false)
+    {
+      for (int i = 1; i < numWorkers; i++)
+      {
+        threads_.push_back(std::thread(&Workers::work, this, i));
+      }
+    }
+
+    ~Workers()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+      }
+      start_.notify_all();
+
+      for (size_t i = 0; i < threads_.size(); i++) threads_[i].join();
+    }
+
+    // Calls [job] once on each worker with that worker's index, from zero up
+    // to numWorkers() - 1, and returns when they're all done.
+    void run(const std::function<void(int)>& job);
+
+    int numWorkers() const { return (int)threads_.size() + 1; }
+
+  private:
+    void work(int worker);
+
+    Workers(const Workers&);
+    Workers& operator=(const Workers&);
+
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+
+    const std::function<void(int)>* job_;
+
+    // Goes up every time run() is called so that the threads can tell a new
+    // job from one they've already done.
+    int generation_;
+    int numPending_;
+    bool quit_;
+  };
+
+  void Workers::run(const std::function<void(int)>& job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = &job;
+      generation_++;
+      numPending_ = (int)threads_.size();
+    }
+    start_.notify_all();
+
+    job(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (numPending_ > 0) done_.wait(lock);
+  }
+
+  void Workers::work(int worker)
+  {
+    int lastGeneration = 0;
+    while (true)
+    {
+      const std::function<void(int)>* job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!quit_ && generation_ == lastGeneration) start_.wait(lock);
+        if (quit_) return;
+
+        lastGeneration = generation_;
+        job = job_;
+      }
+
+      (*job)(worker);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--numPending_ == 0) done_.notify_one();
+    }
+  }
+}
+
+namespace DensePool
+{
+  class Particle
+  {
+  public:
+    void init(double x, double y,
+              double xVel, double yVel, int lifetime)
+    {
+      x_ = x; y_ = y;
+      xVel_ = xVel; yVel_ = yVel;
+      framesLeft_ = lifetime;
+    }
+
+    // Returns true if the particle died this frame. Only live particles are
+    // ever animated, so there's no need to check. One made by a batch with
+    // no lifetime left dies on its first frame.
+    bool animate()
+    {
+      framesLeft_--;
+      x_ += xVel_;
+      y_ += yVel_;
+
+      return framesLeft_ <= 0;
+    }
+
+    double x() const { return x_; }
+    double y() const { return y_; }
+
+  private:
+    int framesLeft_;
+    double x_, y_;
+    double xVel_, yVel_;
+  };
+
+  // Refers to a particle in a ParticlePool. Particles move around inside the
+  // pool, so this is how code outside the pool holds on to one. An id is
+  // only meaningful while its particle is alive. After that it may be
+  // reused.
+  typedef int ParticleId;
+
+  static const ParticleId NO_PARTICLE = -1;
+
+  // Keeps all of the live particles packed together at the front of the
+  // array. When one dies, the last live particle is moved into its place.
+  // That way animate() only touches live particles, and the cost of a frame
+  // depends on how many particles there are, not on the pool's capacity.
+  class ParticlePool
+  {
+  public:
+    ParticlePool(int capacity)
+    : particles_(capacity),
+      ids_(capacity),
+      indexes_(capacity, -1),
+      numLive_(0),
+      createdFrames_(capacity, 0)
+    {
+      // Hand out the low ids first.
+      for (int id = capacity - 1; id >= 0; id--) availableIds_.push_back(id);
+    }
+
+    // Returns NO_PARTICLE if the pool is full or [lifetime] isn't positive.
+    ParticleId create(double x, double y,
+                      double xVel, double yVel, int lifetime);
+
+    // Creates up to [count] particles at once, for things like explosions.
+    // The new particles are a single run at the end of the live ones, and
+    // [generator] is called with each one's position in the batch and the
+    // particle to init(). Returns the number created, which is less than
+    // [count] if the pool fills up.
+    template <class Generator>
+    int createBatch(int count, Generator generator);
+
+    // Returns the particle with [id], or NULL if it has died. The pointer is
+    // only good until the next call to animate().
+    Particle* get(ParticleId id)
+    {
+      int index = indexes_[id];
+      if (index == -1) return NULL;
+      return &particles_[index];
+    }
+
+    void animate();
+
+    // Does the same thing as animate(), but splits the live particles across
+    // [workers]. Each worker gets a run of particles that starts on a cache
+    // line boundary and writes the ones that die to its own list. Nothing
+    // is recycled until they've all finished.
+    void animate(JobSystem::Workers& workers);
+
+    int numLive() const { return numLive_; }
+    int capacity() const { return (int)particles_.size(); }
+
+    // Call once per frame to reset the per-frame counters.
+    void endFrame() { tracker_.endFrame(); }
+    const PoolTelemetry::PoolStats& stats() const { return tracker_.stats(); }
+    const PoolTelemetry::Tracker& tracker() const { return tracker_; }
+
+  private:
+    void kill(int index);
+
+    // Where a worker writes down the particles that died in its chunk. Each
+    // one is on its own cache line so that workers don't slow each other
+    // down writing to them.
+    struct alignas(64) DeadList
+    {
+      std::vector<int> indexes;
+    };
+
+    std::vector<Particle> particles_;
+    std::vector<DeadList> dead_;
+
+    // The id of the particle at each index, and the index of the particle
+    // with each id, or -1 if it isn't alive.
+    std::vector<ParticleId> ids_;
+    std::vector<int> indexes_;
+
+    std::vector<ParticleId> availableIds_;
+    int numLive_;
+
+    // The frame each live id was created in.
+    std::vector<int> createdFrames_;
+    PoolTelemetry::Tracker tracker_;
+  };
+
+  ParticleId ParticlePool::create(double x, double y,
+                                  double xVel, double yVel,
+                                  int lifetime)
+  {
+    // It would already be dead.
+    if (lifetime <= 0) return NO_PARTICLE;
+
+    if (numLive_ == capacity())
+    {
+      tracker_.recordFailure();
+      return NO_PARTICLE;
+    }
+
+    ParticleId id = availableIds_.back();
+    availableIds_.pop_back();
+    createdFrames_[id] = tracker_.frame();
+    tracker_.recordCreate();
+
+    // Add it to the end of the live particles.
+    int index = numLive_++;
+    particles_[index].init(x, y, xVel, yVel, lifetime);
+    ids_[index] = id;
+    indexes_[id] = index;
+
+    return id;
+  }
+
+  template <class Generator>
+  int ParticlePool::createBatch(int count, Generator generator)
+  {
+    assert(count >= 0);
+
+    if (count > capacity() - numLive_)
+    {
+      // Count each particle that didn't fit, like create() does.
+      tracker_.recordFailure(count - (capacity() - numLive_));
+      count = capacity() - numLive_;
+    }
+
+    if (count == 0) return 0;
+
+    // Initialize the whole run in one tight loop over contiguous particles.
+    Particle* batch = &particles_[numLive_];
+    for (int i = 0; i < count; i++) generator(i, batch[i]);
+
+    // Then hand out their ids in a second loop.
+    int firstId = (int)availableIds_.size() - count;
+    for (int i = 0; i < count; i++)
+    {
+      ParticleId id = availableIds_[firstId + i];
+      ids_[numLive_ + i] = id;
+      indexes_[id] = numLive_ + i;
+      createdFrames_[id] = tracker_.frame();
+      tracker_.recordCreate();
+    }
+
+    availableIds_.resize(firstId);
+    numLive_ += count;
+    return count;
+  }
+
+  void ParticlePool::animate()
+  {
+    for (int i = 0; i < numLive_; )
+    {
+      if (particles_[i].animate())
+      {
+        // Don't advance. The particle that was moved into this slot hasn't
+        // been animated yet.
+        kill(i);
+      }
+      else
+      {
+        i++;
+      }
+    }
+  }
+
+  void ParticlePool::animate(JobSystem::Workers& workers)
+  {
+    int numWorkers = workers.numWorkers();
+    if ((int)dead_.size() < numWorkers) dead_.resize(numWorkers);
+
+    // Chunks are a whole number of this many particles, which is the
+    // smallest run that fills a whole number of cache lines.
+    static const int LINE = 64;
+    int perGroup = 1;
+    while ((perGroup * sizeof(Particle)) % LINE != 0) perGroup++;
+
+    // Find the first particle that starts a cache line.
+    int first = 0;
+    while (first < perGroup &&
+           (uintptr_t)&particles_[first] % LINE != 0)
+    {
+      first++;
+    }
+    if (first == perGroup) first = 0;
+
+    int numGroups = (numLive_ - first + perGroup - 1) / perGroup;
+    int groupsPerWorker = (numGroups + numWorkers - 1) / numWorkers;
+    int numLive = numLive_;
+
+    std::function<void(int)> job = [&](int worker) {
+      // The first worker also takes the few particles before the first
+      // aligned one.
+      int begin = worker == 0 ?
+          0 : first + worker * groupsPerWorker * perGroup;
+      int end = first + (worker + 1) * groupsPerWorker * perGroup;
+      if (begin > numLive) begin = numLive;
+      if (end > numLive) end = numLive;
+
+      std::vector<int>& dead = dead_[worker].indexes;
+      dead.clear();
+      for (int i = begin; i < end; i++)
+      {
+        if (particles_[i].animate()) dead.push_back(i);
+      }
+    };
+    workers.run(job);
+
+    // Recycle from the back so that the live particle each kill() moves
+    // into a hole is never one that died this frame.
+    for (int worker = numWorkers - 1; worker >= 0; worker--)
+    {
+      std::vector<int>& dead = dead_[worker].indexes;
+      for (int i = (int)dead.size() - 1; i >= 0; i--) kill(dead[i]);
+    }
+  }
+
+  void ParticlePool::kill(int index)
+  {
+    ParticleId id = ids_[index];
+    indexes_[id] = -1;
+    availableIds_.push_back(id);
+    tracker_.recordDestroy(createdFrames_[id]);
+
+    // Fill the hole with the last live particle.
+    int last = --numLive_;
+    if (index != last)
+    {
+      particles_[index] = particles_[last];
+      ids_[index] = ids_[last];
+      indexes_[ids_[index]] = index;
+    }
+  }
+
+  // Sends particles flying out in every direction from a point.
+  class Burst
+  {
+  public:
+    Burst(double x, int lifetime = 2)
+    : x_(x),
+      lifetime_(lifetime)
+    {}
+
+    void operator()(int i, Particle& particle) const
+    {
+      particle.init(x_, 0, i - 1, 1, lifetime_);
+    }
+
+  private:
+    double x_;
+    int lifetime_;
+  };
+
+  void test()
+  {
+    std::cout << "Testing dense pool" << std::endl;
+
+    ParticlePool pool(4);
+    ParticleId a = pool.create(0, 0, 1, 0, 1);
+    ParticleId b = pool.create(10, 0, 1, 0, 3);
+    ParticleId c = pool.create(20, 0, 1, 0, 1);
+    ParticleId d = pool.create(30, 0, 1, 0, 3);
+    EXPECT(pool.create(0, 0, 0, 0, 1) == NO_PARTICLE);
+
+    // Two die, and the survivors are packed at the front.
+    pool.animate();
+    EXPECT(pool.numLive() == 2);
+    EXPECT(pool.get(a) == NULL);
+    EXPECT(pool.get(c) == NULL);
+    EXPECT(pool.get(b)->x() == 11);
+    EXPECT(pool.get(d)->x() == 31);
+
+    // Every survivor was animated exactly once.
+    pool.animate();
+    EXPECT(pool.get(b)->x() == 12);
+    EXPECT(pool.get(d)->x() == 32);
+
+    ParticleId e = pool.create(40, 0, 1, 0, 5);
+    EXPECT(e != NO_PARTICLE);
+    EXPECT(pool.get(e)->x() == 40);
+
+    pool.animate();
+    EXPECT(pool.numLive() == 1);
+    EXPECT(pool.get(e)->x() == 41);
+
+    // Bursts are clamped to the room left.
+    EXPECT(pool.createBatch(5, Burst(100)) == 3);
+    EXPECT(pool.numLive() == 4);
+    EXPECT(pool.createBatch(1, Burst(100)) == 0);
+    EXPECT(pool.createBatch(0, Burst(100)) == 0);
+    EXPECT(pool.get(e)->x() == 41);
+
+    // The burst particles animate like any others.
+    pool.animate();
+    EXPECT(pool.numLive() == 4);
+    pool.animate();
+    EXPECT(pool.numLive() == 1);
+    EXPECT(pool.get(e)->x() == 43);
+
+    // Nothing called endFrame(), so everything died in frame zero.
+    EXPECT(pool.stats().highWater == 4);
+    EXPECT(pool.stats().destroyedThisFrame == 7);
+    EXPECT(pool.stats().failedThisFrame == 4);
+    EXPECT(pool.stats().lifetimes[0] == 7);
+
+    // Particles that are already dead aren't kept around.
+    EXPECT(pool.create(0, 0, 0, 0, 0) == NO_PARTICLE);
+    EXPECT(pool.createBatch(2, Burst(0, 0)) == 2);
+    pool.animate();
+    EXPECT(pool.numLive() == 1);
+
+    // Animating in parallel kills the same particles and leaves the rest in
+    // the same place.
+    ParticlePool serial(1000);
+    ParticlePool parallel(1000);
+    for (int i = 0; i < 1000; i++)
+    {
+      serial.create(i, 0, 1, 0, i % 7 + 1);
+      parallel.create(i, 0, 1, 0, i % 7 + 1);
+    }
+
+    JobSystem::Workers workers(4);
+    bool same = true;
+    for (int frame = 0; frame < 8; frame++)
+    {
+      serial.animate();
+      parallel.animate(workers);
+
+      same = same && serial.numLive() == parallel.numLive();
+      for (ParticleId id = 0; id < 1000; id++)
+      {
+        Particle* a = serial.get(id);
+        Particle* b = parallel.get(id);
+        if (a == NULL || b == NULL)
+        {
+          same = same && a == b;
+        }
+        else
+        {
+          same = same && a->x() == b->x();
+        }
+      }
+    }
+
+    EXPECT(same);
+    EXPECT(parallel.numLive() == 0);
+  }
+}
+
+#if defined(__cpp_lib_memory_resource)
+namespace PoolResource
+{
+  // Lets standard containers allocate from a HandlePool::Pool. Each
+  // allocation up to BLOCK_SIZE bytes takes one block from the pool, which
+  // suits node-based containers like std::pmr::unordered_map and std::pmr::
+  // list. Anything bigger, or anything that doesn't fit because the pool is
+  // full, goes to [upstream].
+  template <size_t BLOCK_SIZE>
+  class BlockResource : public std::pmr::memory_resource
+  {
+  public:
+    BlockResource(int capacity,
+                  std::pmr::memory_resource* upstream =
+                      std::pmr::get_default_resource())
+    : pool_(capacity),
+      upstream_(upstream)
+    {}
+
+    const PoolTelemetry::PoolStats& stats() const { return pool_.stats(); }
+    void endFrame() { pool_.endFrame(); }
+
+  protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+      if (bytes <= BLOCK_SIZE && alignment <= alignof(Block))
+      {
+        HandlePool::Handle handle = pool_.create();
+        if (handle != HandlePool::NO_HANDLE) return pool_.get(handle);
+      }
+
+      return upstream_->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* memory, size_t bytes, size_t alignment) override
+    {
+      HandlePool::Handle handle =
+          pool_.handleOf(static_cast<Block*>(memory));
+      if (handle != HandlePool::NO_HANDLE)
+      {
+        pool_.destroy(handle);
+      }
+      else
+      {
+        upstream_->deallocate(memory, bytes, alignment);
+      }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other)
+        const noexcept override
+    {
+      return this == &other;
+    }
+
+  private:
+    struct Block
+    {
+      // Don't zero the bytes every time a block is handed out.
+      Block() {}
+
+      alignas(std::max_align_t) unsigned char bytes[BLOCK_SIZE];
+    };
+
+    HandlePool::Pool<Block> pool_;
+    std::pmr::memory_resource* upstream_;
+  };
+
+  // Memory that only lives for one frame. Allocating bumps a pointer through
+  // a fixed buffer and freeing does nothing. Calling reset() at the end of
+  // the frame frees everything at once. If a frame needs more than the
+  // buffer, the extra comes from [upstream] and is freed on reset().
+  class FrameArena : public std::pmr::memory_resource
+  {
+  public:
+    FrameArena(size_t size,
+               std::pmr::memory_resource* upstream =
+                   std::pmr::get_default_resource())
+    : buffer_(static_cast<unsigned char*>(::operator new(size))),
+      size_(size),
+      used_(0),
+      highWater_(0),
+      upstream_(upstream)
+    {}
+
+    ~FrameArena()
+    {
+      reset();
+      ::operator delete(buffer_);
+    }
+
+    // Frees everything allocated since the last reset. Any container still
+    // using this memory must be gone by now.
+    void reset()
+    {
+      for (size_t i = 0; i < overflow_.size(); i++)
+      {
+        upstream_->deallocate(overflow_[i].memory, overflow_[i].bytes,
+                              overflow_[i].alignment);
+      }
+
+      overflow_.clear();
+      used_ = 0;
+    }
+
+    size_t used() const { return used_; }
+
+    // The most that a single frame has used out of the buffer, and how many
+    // allocations didn't fit. If the second isn't zero, make the arena
+    // bigger.
+    size_t highWater() const { return highWater_; }
+    int numOverflows() const { return (int)overflow_.size(); }
+
+  protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+      uintptr_t start = (uintptr_t)buffer_;
+      uintptr_t next = (start + used_ + alignment - 1) &
+                       ~(uintptr_t)(alignment - 1);
+
+      if (next + bytes <= start + size_)
+      {
+        used_ = next + bytes - start;
+        if (used_ > highWater_) highWater_ = used_;
+        return (void*)next;
+      }
+
+      Allocation allocation =
+          { upstream_->allocate(bytes, alignment), bytes, alignment };
+      overflow_.push_back(allocation);
+      return allocation.memory;
+    }
+
+    void do_deallocate(void*, size_t, size_t) override
+    {
+      // Everything is freed in reset().
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other)
+        const noexcept override
+    {
+      return this == &other;
+    }
+
+  private:
+    struct Allocation
+    {
+      void* memory;
+      size_t bytes;
+      size_t alignment;
+    };
+
+    FrameArena(const FrameArena&);
+    FrameArena& operator=(const FrameArena&);
+
+    unsigned char* buffer_;
+    size_t size_;
+    size_t used_;
+    size_t highWater_;
+
+    std::pmr::memory_resource* upstream_;
+    std::vector<Allocation> overflow_;
+  };
+
+  void test()
+  {
+    std::cout << "Testing pool resource" << std::endl;
+
+    {
+      BlockResource<64> blocks(100);
+      std::pmr::unordered_map<int, int> map(&blocks);
+      for (int i = 0; i < 50; i++) map[i] = i * 2;
+      EXPECT(map[49] == 98);
+
+      // The nodes came from the pool.
+      EXPECT(blocks.stats().numLive >= 50);
+
+      map.clear();
+      std::pmr::unordered_map<int, int> empty(&blocks);
+      EXPECT(blocks.stats().numLive == 0);
+
+      // Big allocations go upstream.
+      std::pmr::vector<int> vector(1000, 7, &blocks);
+      EXPECT(vector[999] == 7);
+      EXPECT(blocks.stats().numLive == 0);
+    }
+
+    {
+      FrameArena arena(1024);
+      {
+        std::pmr::vector<int> small(&arena);
+        small.push_back(1);
+        small.push_back(2);
+        EXPECT(arena.used() > 0);
+        EXPECT(arena.numOverflows() == 0);
+
+        // Doesn't fit in the buffer.
+        std::pmr::vector<int> big(1000, 3, &arena);
+        EXPECT(arena.numOverflows() == 1);
+        EXPECT(big[999] == 3);
+      }
+
+      arena.reset();
+      EXPECT(arena.used() == 0);
+      EXPECT(arena.numOverflows() == 0);
+      EXPECT(arena.highWater() > 0);
+    }
+  }
+}
+#endif
+
 // 64 characters --------------------------------------------------------|
 void TestParticlePool()
 {
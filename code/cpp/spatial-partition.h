@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include <thread>
 #include <vector>
 #include "expect.h"
 
@@ -216,9 +220,11 @@ namespace SpatialPartition
   {
     class Unit;
 
+    int numAttacks = 0;
+
     void handleAttack(Unit* unit, Unit* other)
     {
-
+      numAttacks++;
     }
     
     class Grid
@@ -568,10 +574,746 @@ namespace SpatialPartition
     //^handle-unit
   }
 
+  namespace SnapshotGrid
+  {
+    class Unit;
+
+    int numAttacks = 0;
+
+    void handleAttack(Unit* unit, Unit* other)
+    {
+      numAttacks++;
+    }
+
+    static const int NUM_CELLS = 10;
+    static const int CELL_SIZE = 20;
+
+    // An immutable copy of where every unit was at the end of a frame. The
+    // units in each cell are packed next to each other, so a cell is a slice
+    // of one flat array instead of a linked list threaded through the live
+    // units. Other threads can query it while the simulation keeps moving
+    // units around in the live grid.
+    class Snapshot
+    {
+      friend class Grid;
+
+    public:
+      Snapshot()
+      : readers_(0)
+      {
+        for (int i = 0; i <= NUM_CELLS * NUM_CELLS; i++)
+        {
+          cellStart_[i] = 0;
+        }
+      }
+
+      Unit* findAt(double x, double y) const;
+
+      // Fills [results] with up to [maxResults] units within [radius] of the
+      // given point. Returns the number found.
+      int findNear(double x, double y, double radius,
+                   Unit** results, int maxResults) const;
+
+      int numUnits() const { return (int)entries_.size(); }
+
+    private:
+      struct Entry
+      {
+        double x, y;
+        Unit* unit;
+      };
+
+      // Units in cell (x, y) are entries_[cellStart_[i]] up to (but not
+      // including) entries_[cellStart_[i + 1]], where i is x * NUM_CELLS + y.
+      int cellStart_[NUM_CELLS * NUM_CELLS + 1];
+      std::vector<Entry> entries_;
+
+      // How many threads are currently reading this snapshot. The grid won't
+      // overwrite it until this drops to zero.
+      mutable std::atomic<int> readers_;
+    };
+
+    class Grid
+    {
+    public:
+      Grid()
+      : current_(&snapshots_[0])
+      {
+        // Clear the grid.
+        for (int x = 0; x < NUM_CELLS; x++)
+        {
+          for (int y = 0; y < NUM_CELLS; y++)
+          {
+            cells_[x][y] = NULL;
+          }
+        }
+      }
+
+      void move(Unit* unit, double x, double y);
+      void add(Unit* unit);
+
+      Unit* findAt(double x, double y);
+
+      void handleMelee();
+      void handleCell(Unit* unit);
+
+      // Copies the current unit positions into the snapshot that readers
+      // are not using and makes it the current one. Call this from the
+      // simulation thread at the end of each frame.
+      void publish();
+
+      // Gets the most recently published snapshot. It will not be touched
+      // until it is passed back to releaseSnapshot(). Safe to call from any
+      // thread, and never waits on the simulation thread.
+      const Snapshot* acquireSnapshot() const;
+      void releaseSnapshot(const Snapshot* snapshot) const;
+
+    private:
+      Unit* cells_[NUM_CELLS][NUM_CELLS];
+
+      Snapshot snapshots_[2];
+      std::atomic<Snapshot*> current_;
+    };
+
+    class Unit
+    {
+      friend class Grid;
+
+    public:
+      const char* name;
+
+      Unit(Grid* grid, double x, double y)
+      : name(NULL),
+        x_(x),
+        y_(y),
+        grid_(grid),
+        prev_(NULL),
+        next_(NULL)
+      {
+        grid_->add(this);
+      }
+
+      void move(double x, double y);
+
+    private:
+      double x_, y_;
+
+      Grid* grid_;
+
+      Unit* prev_;
+      Unit* next_;
+    };
+
+    void Unit::move(double x, double y)
+    {
+      grid_->move(this, x, y);
+    }
+
+    void Grid::move(Unit* unit, double x, double y)
+    {
+      // See which cell it was in.
+      int oldCellX = (int)(unit->x_ / CELL_SIZE);
+      int oldCellY = (int)(unit->y_ / CELL_SIZE);
+
+      // See which cell it's moving to.
+      int cellX = (int)(x / CELL_SIZE);
+      int cellY = (int)(y / CELL_SIZE);
+
+      unit->x_ = x;
+      unit->y_ = y;
+
+      // If it didn't change cells, we're done.
+      if (oldCellX == cellX && oldCellY == cellY) return;
+
+      // Unlink it from the list of its old cell.
+      if (unit->prev_ != NULL)
+      {
+        unit->prev_->next_ = unit->next_;
+      }
+
+      if (unit->next_ != NULL)
+      {
+        unit->next_->prev_ = unit->prev_;
+      }
+
+      // If it's the head of a list, remove it.
+      if (cells_[oldCellX][oldCellY] == unit)
+      {
+        cells_[oldCellX][oldCellY] = unit->next_;
+      }
+
+      // Add it back to the grid at its new cell.
+      add(unit);
+    }
+
+    void Grid::add(Unit* unit)
+    {
+      // Determine which grid cell it's in.
+      int cellX = (int)(unit->x_ / CELL_SIZE);
+      int cellY = (int)(unit->y_ / CELL_SIZE);
+
+      // Add to the front of list for the cell its in.
+      unit->prev_ = NULL;
+      unit->next_ = cells_[cellX][cellY];
+      cells_[cellX][cellY] = unit;
+
+      if (unit->next_ != NULL)
+      {
+        unit->next_->prev_ = unit;
+      }
+    }
+
+    Unit* Grid::findAt(double x, double y)
+    {
+      int cellX = (int)(x / CELL_SIZE);
+      int cellY = (int)(y / CELL_SIZE);
+
+      Unit* unit = cells_[cellX][cellY];
+      while (unit != NULL)
+      {
+        if (unit->x_ == x && unit->y_ == y) return unit;
+        unit = unit->next_;
+      }
+
+      return NULL;
+    }
+
+    void Grid::handleMelee()
+    {
+      for (int x = 0; x < NUM_CELLS; x++)
+      {
+        for (int y = 0; y < NUM_CELLS; y++)
+        {
+          handleCell(cells_[x][y]);
+        }
+      }
+    }
+
+    void Grid::handleCell(Unit* unit)
+    {
+      while (unit != NULL)
+      {
+        Unit* other = unit->next_;
+        while (other != NULL)
+        {
+          if (unit->x_ == other->x_ &&
+              unit->y_ == other->y_)
+          {
+            handleAttack(unit, other);
+          }
+          other = other->next_;
+        }
+
+        unit = unit->next_;
+      }
+    }
+
+    void Grid::publish()
+    {
+      Snapshot* current = current_.load();
+      Snapshot* back = (current == &snapshots_[0]) ?
+          &snapshots_[1] : &snapshots_[0];
+
+      // Wait for anyone still reading the old snapshot we're about to reuse.
+      // Readers only hold on to it for the length of a query, and new
+      // readers always go to the current one, so this is short.
+      while (back->readers_.load() > 0) std::this_thread::yield();
+
+      back->entries_.clear();
+      for (int x = 0; x < NUM_CELLS; x++)
+      {
+        for (int y = 0; y < NUM_CELLS; y++)
+        {
+          back->cellStart_[x * NUM_CELLS + y] = (int)back->entries_.size();
+
+          for (Unit* unit = cells_[x][y]; unit != NULL; unit = unit->next_)
+          {
+            Snapshot::Entry entry = { unit->x_, unit->y_, unit };
+            back->entries_.push_back(entry);
+          }
+        }
+      }
+      back->cellStart_[NUM_CELLS * NUM_CELLS] = (int)back->entries_.size();
+
+      current_.store(back);
+    }
+
+    const Snapshot* Grid::acquireSnapshot() const
+    {
+      while (true)
+      {
+        Snapshot* snapshot = current_.load();
+        snapshot->readers_.fetch_add(1);
+
+        // If the grid swapped in a new snapshot between loading the pointer
+        // and registering as a reader, it may already be rebuilding this one.
+        if (current_.load() == snapshot) return snapshot;
+
+        snapshot->readers_.fetch_sub(1);
+      }
+    }
+
+    void Grid::releaseSnapshot(const Snapshot* snapshot) const
+    {
+      snapshot->readers_.fetch_sub(1);
+    }
+
+    Unit* Snapshot::findAt(double x, double y) const
+    {
+      int cellX = (int)(x / CELL_SIZE);
+      int cellY = (int)(y / CELL_SIZE);
+      int cell = cellX * NUM_CELLS + cellY;
+
+      for (int i = cellStart_[cell]; i < cellStart_[cell + 1]; i++)
+      {
+        if (entries_[i].x == x && entries_[i].y == y) return entries_[i].unit;
+      }
+
+      return NULL;
+    }
+
+    int Snapshot::findNear(double x, double y, double radius,
+                           Unit** results, int maxResults) const
+    {
+      // Only look at the cells the circle overlaps.
+      int minX = std::max(0, (int)((x - radius) / CELL_SIZE));
+      int maxX = std::min(NUM_CELLS - 1, (int)((x + radius) / CELL_SIZE));
+      int minY = std::max(0, (int)((y - radius) / CELL_SIZE));
+      int maxY = std::min(NUM_CELLS - 1, (int)((y + radius) / CELL_SIZE));
+
+      int numResults = 0;
+      for (int cellX = minX; cellX <= maxX; cellX++)
+      {
+        for (int cellY = minY; cellY <= maxY; cellY++)
+        {
+          int cell = cellX * NUM_CELLS + cellY;
+          for (int i = cellStart_[cell]; i < cellStart_[cell + 1]; i++)
+          {
+            double dx = entries_[i].x - x;
+            double dy = entries_[i].y - y;
+            if (dx * dx + dy * dy > radius * radius) continue;
+
+            if (numResults == maxResults) return numResults;
+            results[numResults++] = entries_[i].unit;
+          }
+        }
+      }
+
+      return numResults;
+    }
+
+    void test()
+    {
+      Grid grid;
+
+      Unit a(&grid, 10, 10); a.name = "a";
+      Unit b(&grid, 50, 65); b.name = "b";
+      Unit c(&grid, 55, 65); c.name = "c";
+
+      grid.publish();
+      a.move(20, 100);
+
+      // Readers don't see moves until the next publish.
+      const Snapshot* snapshot = grid.acquireSnapshot();
+      EXPECT(snapshot->numUnits() == 3);
+      EXPECT(snapshot->findAt(10, 10) == &a);
+      EXPECT(snapshot->findAt(20, 100) == NULL);
+
+      Unit* near[3];
+      EXPECT(snapshot->findNear(52, 65, 4, near, 3) == 2);
+      grid.releaseSnapshot(snapshot);
+
+      grid.publish();
+      snapshot = grid.acquireSnapshot();
+      EXPECT(snapshot->findAt(10, 10) == NULL);
+      EXPECT(snapshot->findAt(20, 100) == &a);
+      grid.releaseSnapshot(snapshot);
+
+      // Hammer the snapshots from another thread while this one keeps
+      // moving units and publishing. Every snapshot must be complete.
+      std::atomic<bool> done(false);
+      std::atomic<int> numBad(0);
+      std::thread reader([&]() {
+        while (!done.load())
+        {
+          const Snapshot* snapshot = grid.acquireSnapshot();
+          Unit* found[3];
+          if (snapshot->numUnits() != 3 ||
+              snapshot->findNear(100, 100, 200, found, 3) != 3)
+          {
+            numBad++;
+          }
+          grid.releaseSnapshot(snapshot);
+        }
+      });
+
+      for (int i = 0; i < 10000; i++)
+      {
+        b.move(i % 200, 65);
+        c.move(55, i % 200);
+        grid.publish();
+      }
+
+      done.store(true);
+      reader.join();
+      EXPECT(numBad.load() == 0);
+    }
+  }
+
+  namespace PooledGrid
+  {
+    static const int NUM_CELLS = 10;
+    static const int CELL_SIZE = 20;
+
+    // Identifies a unit owned by the grid. The low INDEX_BITS are the unit's
+    // slot in the grid's slab and the rest are the slot's generation, which
+    // changes every time the slot is freed. That way a handle to a destroyed
+    // unit is detected instead of pointing at whatever reused its slot.
+    typedef uint32_t UnitHandle;
+
+    static const UnitHandle NO_UNIT = 0;
+    static const int INDEX_BITS = 20;
+    static const uint32_t INDEX_MASK = (1 << INDEX_BITS) - 1;
+    static const uint32_t GENERATION_MASK = (1 << (32 - INDEX_BITS)) - 1;
+    static const int MAX_UNITS = 1 << INDEX_BITS;
+
+    int numAttacks = 0;
+
+    void handleAttack(UnitHandle unit, UnitHandle other)
+    {
+      numAttacks++;
+    }
+
+    // What gets written out for each unit when saving the grid.
+    struct SavedUnit
+    {
+      double x, y;
+    };
+
+    class Grid
+    {
+    public:
+      Grid()
+      : firstAvailable_(-1),
+        numUnits_(0)
+      {
+        // Clear the grid.
+        for (int x = 0; x < NUM_CELLS; x++)
+        {
+          for (int y = 0; y < NUM_CELLS; y++)
+          {
+            cells_[x][y] = -1;
+          }
+        }
+      }
+
+      // Adds a new unit to the grid. Returns NO_UNIT if the grid is full.
+      UnitHandle create(double x, double y);
+      void destroy(UnitHandle handle);
+      bool isValid(UnitHandle handle) const;
+
+      // Returns false if [handle] refers to a destroyed unit.
+      bool move(UnitHandle handle, double x, double y);
+
+      UnitHandle findAt(double x, double y) const;
+
+      void handleMelee();
+
+      int numUnits() const { return numUnits_; }
+
+      // Writes every live unit to [units] in slab order. Since the grid owns
+      // all of the units, this is a single pass over contiguous memory.
+      void save(std::vector<SavedUnit>& units) const;
+
+      // Destroys every unit and recreates the ones in [units]. They fill the
+      // slab from the start in the same order as the saved units, and so do
+      // the handles.
+      void load(const std::vector<SavedUnit>& units,
+                std::vector<UnitHandle>& handles);
+
+    private:
+      struct Unit
+      {
+        double x, y;
+
+        // While the unit is live, these link it into its cell's list. Once
+        // it's destroyed, [next] links it into the free list instead.
+        int prev;
+        int next;
+
+        uint32_t generation;
+        bool live;
+      };
+
+      UnitHandle handleFor(int index) const
+      {
+        return (units_[index].generation << INDEX_BITS) | (uint32_t)index;
+      }
+
+      // Returns the slab index [handle] refers to, or -1 if it's stale.
+      int indexOf(UnitHandle handle) const;
+
+      void link(int index);
+      void unlink(int index);
+      void handleCell(int index);
+
+      // Index of the first unit in each cell's list, or -1 if it's empty.
+      int cells_[NUM_CELLS][NUM_CELLS];
+
+      std::vector<Unit> units_;
+      int firstAvailable_;
+      int numUnits_;
+    };
+
+    UnitHandle Grid::create(double x, double y)
+    {
+      int index = firstAvailable_;
+      if (index != -1)
+      {
+        firstAvailable_ = units_[index].next;
+      }
+      else
+      {
+        if ((int)units_.size() == MAX_UNITS) return NO_UNIT;
+
+        // Generations start at one so that no handle is ever NO_UNIT.
+        Unit unit = { 0, 0, -1, -1, 1, false };
+        units_.push_back(unit);
+        index = (int)units_.size() - 1;
+      }
+
+      Unit& unit = units_[index];
+      unit.x = x;
+      unit.y = y;
+      unit.live = true;
+      link(index);
+
+      numUnits_++;
+      return handleFor(index);
+    }
+
+    void Grid::destroy(UnitHandle handle)
+    {
+      int index = indexOf(handle);
+      if (index == -1) return;
+
+      unlink(index);
+
+      Unit& unit = units_[index];
+      unit.live = false;
+      unit.generation = (unit.generation + 1) & GENERATION_MASK;
+      if (unit.generation == 0) unit.generation = 1;
+
+      // Add it to the front of the free list.
+      unit.next = firstAvailable_;
+      firstAvailable_ = index;
+
+      numUnits_--;
+    }
+
+    bool Grid::isValid(UnitHandle handle) const
+    {
+      return indexOf(handle) != -1;
+    }
+
+    int Grid::indexOf(UnitHandle handle) const
+    {
+      int index = (int)(handle & INDEX_MASK);
+      if (index >= (int)units_.size()) return -1;
+
+      const Unit& unit = units_[index];
+      if (!unit.live || unit.generation != handle >> INDEX_BITS) return -1;
+
+      return index;
+    }
+
+    bool Grid::move(UnitHandle handle, double x, double y)
+    {
+      int index = indexOf(handle);
+      if (index == -1) return false;
+
+      Unit& unit = units_[index];
+      int oldCellX = (int)(unit.x / CELL_SIZE);
+      int oldCellY = (int)(unit.y / CELL_SIZE);
+      int cellX = (int)(x / CELL_SIZE);
+      int cellY = (int)(y / CELL_SIZE);
+
+      if (oldCellX == cellX && oldCellY == cellY)
+      {
+        unit.x = x;
+        unit.y = y;
+        return true;
+      }
+
+      unlink(index);
+      unit.x = x;
+      unit.y = y;
+      link(index);
+      return true;
+    }
+
+    void Grid::link(int index)
+    {
+      Unit& unit = units_[index];
+      int cellX = (int)(unit.x / CELL_SIZE);
+      int cellY = (int)(unit.y / CELL_SIZE);
+
+      // Add to the front of list for the cell it's in.
+      unit.prev = -1;
+      unit.next = cells_[cellX][cellY];
+      cells_[cellX][cellY] = index;
+
+      if (unit.next != -1) units_[unit.next].prev = index;
+    }
+
+    void Grid::unlink(int index)
+    {
+      Unit& unit = units_[index];
+      if (unit.prev != -1) units_[unit.prev].next = unit.next;
+      if (unit.next != -1) units_[unit.next].prev = unit.prev;
+
+      // If it's the head of a list, remove it.
+      int cellX = (int)(unit.x / CELL_SIZE);
+      int cellY = (int)(unit.y / CELL_SIZE);
+      if (cells_[cellX][cellY] == index) cells_[cellX][cellY] = unit.next;
+    }
+
+    UnitHandle Grid::findAt(double x, double y) const
+    {
+      int cellX = (int)(x / CELL_SIZE);
+      int cellY = (int)(y / CELL_SIZE);
+
+      for (int index = cells_[cellX][cellY]; index != -1;
+           index = units_[index].next)
+      {
+        if (units_[index].x == x && units_[index].y == y)
+        {
+          return handleFor(index);
+        }
+      }
+
+      return NO_UNIT;
+    }
+
+    void Grid::handleMelee()
+    {
+      for (int x = 0; x < NUM_CELLS; x++)
+      {
+        for (int y = 0; y < NUM_CELLS; y++)
+        {
+          handleCell(cells_[x][y]);
+        }
+      }
+    }
+
+    void Grid::handleCell(int index)
+    {
+      while (index != -1)
+      {
+        const Unit& unit = units_[index];
+        for (int other = unit.next; other != -1; other = units_[other].next)
+        {
+          if (unit.x == units_[other].x && unit.y == units_[other].y)
+          {
+            handleAttack(handleFor(index), handleFor(other));
+          }
+        }
+
+        index = unit.next;
+      }
+    }
+
+    void Grid::save(std::vector<SavedUnit>& units) const
+    {
+      units.clear();
+      for (size_t i = 0; i < units_.size(); i++)
+      {
+        if (!units_[i].live) continue;
+
+        SavedUnit saved = { units_[i].x, units_[i].y };
+        units.push_back(saved);
+      }
+    }
+
+    void Grid::load(const std::vector<SavedUnit>& units,
+                    std::vector<UnitHandle>& handles)
+    {
+      for (size_t i = 0; i < units_.size(); i++)
+      {
+        if (units_[i].live) destroy(handleFor((int)i));
+      }
+
+      // Destroying them left the free list in whatever order they died.
+      // Rebuild it in slab order so the loaded units end up contiguous.
+      firstAvailable_ = -1;
+      for (int i = (int)units_.size() - 1; i >= 0; i--)
+      {
+        units_[i].next = firstAvailable_;
+        firstAvailable_ = i;
+      }
+
+      handles.clear();
+      for (size_t i = 0; i < units.size(); i++)
+      {
+        handles.push_back(create(units[i].x, units[i].y));
+      }
+    }
+
+    void test()
+    {
+      Grid grid;
+
+      UnitHandle a = grid.create(0, 0);
+      UnitHandle b = grid.create(0, 0);
+      UnitHandle c = grid.create(0, 0);
+
+      grid.move(b, 50, 65);
+      grid.move(c, 55, 65);
+      grid.move(a, 20, 100);
+      grid.move(c, 22, 100);
+
+      EXPECT(grid.findAt(20, 100) == a);
+      EXPECT(grid.findAt(50, 65) == b);
+      EXPECT(grid.findAt(22, 100) == c);
+
+      // A destroyed unit's handle stays dead even after its slot is reused.
+      grid.destroy(b);
+      UnitHandle d = grid.create(1, 2);
+      EXPECT(!grid.isValid(b));
+      EXPECT(grid.isValid(d));
+      EXPECT(!grid.move(b, 3, 4));
+      EXPECT(grid.findAt(50, 65) == NO_UNIT);
+      EXPECT(grid.findAt(1, 2) == d);
+
+      std::vector<SavedUnit> saved;
+      grid.save(saved);
+      EXPECT(saved.size() == 3);
+
+      Grid loaded;
+      std::vector<UnitHandle> handles;
+      loaded.load(saved, handles);
+      EXPECT(loaded.numUnits() == 3);
+      EXPECT(loaded.findAt(22, 100) != NO_UNIT);
+
+      // Loading over live units still lays them out in order, and the old
+      // handles die.
+      grid.create(5, 5);
+      grid.load(saved, handles);
+      EXPECT(grid.numUnits() == 3);
+      EXPECT(!grid.isValid(a));
+      for (int i = 0; i < 3; i++)
+      {
+        EXPECT((handles[i] & INDEX_MASK) == (UnitHandle)i);
+      }
+    }
+  }
+
   void test()
   {
     printf("Testing Spatial Partition\n");
     NaiveCollision::test();
     FixedGrid::test();
+    SnapshotGrid::test();
+    PooledGrid::test();
   }
 }